@@ -0,0 +1,304 @@
+// Microbenchmarks for the hot paths of hello.cpp: snapshot load/save, page
+// rendering, strategy suggestions, a logMood through the server, URL decoding
+// and request parsing, over synthetic states from empty up to 1M journal
+// entries and 100k strategies.
+//
+//   g++ -std=c++17 -O2 -pthread bench.cpp -o bench
+//   ./bench                    # table for humans
+//   ./bench --json             # one JSON object per line, for tracking releases
+//   ./bench --max-entries 10000 --filter saveState
+#define MHS_NO_MAIN
+#include "hello.cpp"
+
+#include <chrono>
+#include <atomic>
+#include <dirent.h>
+
+// Every allocation in the process goes through here so each case can report
+// how many allocations one call makes. (GCC cannot see that these new and
+// delete replacements pair up once they are inlined.)
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+static atomic<unsigned long long> allocationCount(0);
+static atomic<unsigned long long> allocationBytes(0);
+
+void* operator new(size_t size) {
+    allocationCount.fetch_add(1, memory_order_relaxed);
+    allocationBytes.fetch_add(size, memory_order_relaxed);
+    void* p = malloc(size == 0 ? 1 : size);
+    if (p == NULL) throw bad_alloc();
+    return p;
+}
+
+void operator delete(void* p) noexcept {
+    free(p);
+}
+
+void operator delete(void* p, size_t) noexcept {
+    free(p);
+}
+
+struct BenchResult {
+    string name;
+    size_t entries = 0;
+    size_t strategies = 0;
+    size_t iterations = 0;
+    double p50 = 0, p90 = 0, p99 = 0, maxNs = 0; // per call, nanoseconds
+    double opsPerSec = 0;
+    double bytesPerOp = 0; // input or output size the call works through
+    double allocsPerOp = 0;
+    double allocBytesPerOp = 0;
+};
+
+struct BenchOptions {
+    bool json = false;
+    size_t maxEntries = 1000000;
+    string filter;
+    double minSeconds = 0.3; // per case, after at least minIterations calls
+    size_t minIterations = 3;
+};
+
+// Runs 'call' until both the time and iteration floors are met
+template <typename Call>
+BenchResult measure(const BenchOptions& options, const string& name, size_t entries, size_t strategies,
+                    size_t bytesPerOp, Call call) {
+    BenchResult result;
+    result.name = name;
+    result.entries = entries;
+    result.strategies = strategies;
+    result.bytesPerOp = bytesPerOp;
+
+    vector<double> latencies;
+    double total = 0;
+    unsigned long long allocsBefore = allocationCount.load();
+    unsigned long long bytesBefore = allocationBytes.load();
+    while (latencies.size() < options.minIterations || (total < options.minSeconds && latencies.size() < 1000000)) {
+        auto start = chrono::steady_clock::now();
+        call();
+        double ns = chrono::duration<double, nano>(chrono::steady_clock::now() - start).count();
+        latencies.push_back(ns);
+        total += ns / 1e9;
+    }
+    // The latency vector's own growth is counted too; it is amortized O(1) per call
+    result.iterations = latencies.size();
+    result.allocsPerOp = (double)(allocationCount.load() - allocsBefore) / latencies.size();
+    result.allocBytesPerOp = (double)(allocationBytes.load() - bytesBefore) / latencies.size();
+
+    sort(latencies.begin(), latencies.end());
+    auto percentile = [&latencies](double p) { return latencies[min(latencies.size() - 1, (size_t)(p * latencies.size()))]; };
+    result.p50 = percentile(0.50);
+    result.p90 = percentile(0.90);
+    result.p99 = percentile(0.99);
+    result.maxNs = latencies.back();
+    result.opsPerSec = latencies.size() / total;
+    return result;
+}
+
+void report(const BenchOptions& options, const BenchResult& r) {
+    if (options.json) {
+        printf("{\"benchmark\":\"%s\",\"entries\":%zu,\"strategies\":%zu,\"iterations\":%zu,"
+               "\"p50_ns\":%.0f,\"p90_ns\":%.0f,\"p99_ns\":%.0f,\"max_ns\":%.0f,\"ops_per_sec\":%.2f,"
+               "\"bytes_per_op\":%.0f,\"mb_per_sec\":%.2f,\"allocs_per_op\":%.1f,\"alloc_bytes_per_op\":%.0f}\n",
+               r.name.c_str(), r.entries, r.strategies, r.iterations, r.p50, r.p90, r.p99, r.maxNs, r.opsPerSec,
+               r.bytesPerOp, r.bytesPerOp * r.opsPerSec / 1e6, r.allocsPerOp, r.allocBytesPerOp);
+    } else {
+        printf("%-16s %9zu %10zu %8zu %12.0f %12.0f %12.0f %12.1f %9.1f %12.1f\n",
+               r.name.c_str(), r.entries, r.strategies, r.iterations, r.p50, r.p90, r.p99,
+               r.opsPerSec, r.bytesPerOp * r.opsPerSec / 1e6, r.allocsPerOp);
+    }
+    fflush(stdout);
+}
+
+// A state with 'entries' journal entries and mood events (one per minute)
+// and 'strategies' coping strategies, sized so nothing is evicted.
+MentalHealthState syntheticState(size_t entries, size_t strategies) {
+    MentalHealthState state;
+    size_t capacity = max<size_t>(entries, 1);
+    vector<MoodEvent> noMoods;
+    state.moodHistory.setCapacity(capacity, noMoods);
+    vector<pair<string, string>> noThoughts;
+    state.thoughtJournal.setCapacity(capacity, noThoughts);
+
+    time_t start = time(0) - (time_t)entries * 60;
+    MoodEvent evicted;
+    for (size_t i = 0; i < entries; i++) {
+        MoodId mood = (MoodId)(i * 7 % MOOD_COUNT);
+        state.moodHistory.record(start + (time_t)i * 60, mood, 2 * i + 1, evicted);
+        state.moodStatistics[mood]++;
+        state.currentMood = mood;
+        state.thoughtJournal.push_back({"Synthetic journal entry " + to_string(i) +
+                                        " about sleep, work & friends <3", "2026-01-01 12:00"});
+        state.thoughtVersions.push_back(2 * i + 2);
+    }
+    state.thoughtsRecorded = entries;
+    for (size_t i = 0; i < strategies; i++) {
+        state.copingStrategies.add("Strategy " + to_string(i) + ": breathe slowly and count to ten");
+    }
+    state.lastStrategyUsed = strategies > 0 ? state.copingStrategies[0].text : "None yet";
+    state.lastStrategyTime = time(0) - 3600;
+    state.version = 2 * entries;
+    return state;
+}
+
+// 'length' bytes of form data: words, '+' spaces and %XX escapes
+string syntheticEncoded(size_t length) {
+    const string pattern = "feeling+calm%2C+slept+8h%21+%F0%9F%98%8C+";
+    string encoded;
+    encoded.reserve(length + pattern.size());
+    while (encoded.size() < length) encoded += pattern;
+    encoded.resize(length);
+    return encoded;
+}
+
+bool selected(const BenchOptions& options, const string& name) {
+    return options.filter.empty() || name.find(options.filter) != string::npos;
+}
+
+// Deletes 'path' and everything under it
+void removeTree(const string& path) {
+    DIR* dir = opendir(path.c_str());
+    if (dir == NULL) {
+        unlink(path.c_str());
+        return;
+    }
+    while (dirent* entry = readdir(dir)) {
+        string name = entry->d_name;
+        if (name != "." && name != "..") removeTree(path + "/" + name);
+    }
+    closedir(dir);
+    rmdir(path.c_str());
+}
+
+int main(int argc, char* argv[]) {
+    BenchOptions options;
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if (arg == "--json") options.json = true;
+        else if (arg == "--max-entries" && i + 1 < argc) options.maxEntries = strtoul(argv[++i], NULL, 10);
+        else if (arg == "--filter" && i + 1 < argc) options.filter = argv[++i];
+        else if (arg == "--min-seconds" && i + 1 < argc) options.minSeconds = atof(argv[++i]);
+        else {
+            fprintf(stderr, "usage: %s [--json] [--max-entries N] [--filter NAME] [--min-seconds S]\n", argv[0]);
+            return 2;
+        }
+    }
+
+    char dirTemplate[] = "/tmp/mhs-bench-XXXXXX";
+    if (mkdtemp(dirTemplate) == NULL) {
+        perror("mkdtemp");
+        return 1;
+    }
+    StatePaths paths = statePathsIn(dirTemplate);
+    // The server keeps DATA_DIR and the population counters in its working directory
+    if (chdir(dirTemplate) != 0) {
+        perror(dirTemplate);
+        return 1;
+    }
+    ServerContext* server = nullptr; // made on first use; its commit thread runs until exit
+
+    if (!options.json) {
+        printf("%-16s %9s %10s %8s %12s %12s %12s %12s %9s %12s\n", "benchmark", "entries", "strategies",
+               "iters", "p50 ns", "p90 ns", "p99 ns", "ops/s", "MB/s", "allocs/op");
+    }
+
+    const size_t sizes[][2] = {{0, 0}, {100, 10}, {10000, 1000}, {100000, 10000}, {1000000, 100000}};
+    for (const auto& size : sizes) {
+        size_t entries = size[0], strategies = size[1];
+        if (entries > options.maxEntries) break;
+        MentalHealthState state = syntheticState(entries, strategies);
+
+        saveState(paths, state);
+        struct stat st;
+        size_t snapshotBytes = stat(paths.snapshot.c_str(), &st) == 0 ? st.st_size : 0;
+        if (selected(options, "saveState")) {
+            report(options, measure(options, "saveState", entries, strategies, snapshotBytes, [&] {
+                if (!saveState(paths, state)) abort();
+            }));
+        }
+        if (selected(options, "loadState")) {
+            report(options, measure(options, "loadState", entries, strategies, snapshotBytes, [&] {
+                MentalHealthState loaded;
+                if (!loadState(paths, loaded) || loaded.thoughtsRecorded != entries) abort();
+            }));
+        }
+        if (selected(options, "printPage")) {
+            AppConfig config = defaultConfig();
+            string page;
+            printPage(page, state, config);
+            size_t pageBytes = page.size();
+            report(options, measure(options, "printPage", entries, strategies, pageBytes, [&] {
+                page.clear();
+                printPage(page, state, config);
+            }));
+        }
+        if (selected(options, "suggestStrategy") && strategies > 0) {
+            // Suggest then use, so the weights keep changing under the sampler
+            AppConfig config = defaultConfig();
+            RequestParams suggest, use;
+            suggest.action = "suggestStrategy";
+            use.action = "useStrategy";
+            Mutation m;
+            report(options, measure(options, "suggestStrategy", entries, strategies, 0, [&] {
+                if (!resolveAction(state, config, suggest, m)) abort();
+                applyMutation(state, m);
+                if (!resolveAction(state, config, use, m)) abort();
+                applyMutation(state, m);
+            }));
+        }
+        if (selected(options, "serveLogMood")) {
+            // One cached user's logMood through the server's handlers: the
+            // log append, its group commit and the page that answers it
+            if (server == nullptr) {
+                server = new ServerContext;
+                thread(runGroupCommit, ref(server->commits)).detach();
+            }
+            string session = newSessionId();
+            if (!ensureUserStateDir(session) || !saveState(statePathsIn(userStateDir(session)), state)) abort();
+            int out = memfd_create("bench-response", 0);
+            if (out < 0) abort();
+            HttpRequest req;
+            req.method = "GET";
+            req.path = "/";
+            req.headers["cookie"] = SESSION_COOKIE + "=" + session;
+            req.keepAlive = true;
+            dispatchRequest(*server, out, req); // loads the user, untimed
+            req.method = "POST";
+            req.headers["content-type"] = "application/x-www-form-urlencoded";
+            const vector<MoodId>& moods = defaultConfig().offeredMoods;
+            size_t logged = 0;
+            report(options, measure(options, "serveLogMood", entries, strategies, 0, [&] {
+                req.body = "action=logMood&moodInput=" + string(moodName(moods[logged++ % moods.size()]));
+                if (lseek(out, 0, SEEK_SET) != 0 || ftruncate(out, 0) != 0) abort();
+                dispatchRequest(*server, out, req);
+                char status[12];
+                if (pread(out, status, sizeof(status), 0) != sizeof(status) ||
+                    memcmp(status, "HTTP/1.1 200", sizeof(status)) != 0) {
+                    abort();
+                }
+            }));
+            close(out);
+        }
+        unlink(paths.snapshot.c_str());
+    }
+
+    // Decoding and parsing only depend on the input size
+    const size_t lengths[] = {64, 4096, 1 << 20};
+    for (size_t length : lengths) {
+        string encoded = syntheticEncoded(length);
+        if (selected(options, "urlDecode")) {
+            report(options, measure(options, "urlDecode", length, 0, length, [&] {
+                string decoded = urlDecode(encoded);
+                if (decoded.empty()) abort();
+            }));
+        }
+        if (selected(options, "parseRequest")) {
+            string body = "action=addThought&thoughtInput=" + encoded;
+            report(options, measure(options, "parseRequest", length, 0, body.size() + 32, [&] {
+                RequestParams params = parseRequest("action=searchThoughts&q=calm+sle*", body);
+                if (params.thoughtInput.empty()) abort();
+            }));
+        }
+    }
+
+    removeTree(dirTemplate);
+    return 0;
+}
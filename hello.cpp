@@ -1,7 +1,11 @@
 #include <iostream>
 #include <fstream>
 #include <string>
+#include <string_view>
+#include <cstdint>
+#include <climits>
 #include <vector>
+#include <array>
 #include <deque>
 #include <map>
 #include <ctime>
@@ -10,542 +14,5212 @@
 #include <algorithm>
 #include <random>
 #include <iomanip>
+#include <queue>
+#include <list>
+#include <unordered_map>
+#include <unordered_set>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <cerrno>
+#include <csignal>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
 using namespace std;
 
-const string STATE_FILE = "mental_health_state.txt";
+const string SNAPSHOT_FILE = "mental_health_state.bin";
+const string STATE_FILE = "mental_health_state.txt"; // legacy text format, migrated on first load
 const string CONFIG_FILE = "mental_health_config.txt";
+const string LOG_FILE = "mental_health_state.log";
+const string COMPACTING_LOG_FILE = "mental_health_state.log.compacting";
+const size_t LOG_COMPACT_BYTES = 64 * 1024;
+const string LOCK_FILE = "state.lock";
+const string METRICS_FILE = "mental_health_metrics.bin";
+const string AGGREGATE_FILE = "mental_health_population.bin";       // live population mood counters
+const string AGGREGATE_CHECKPOINT = "mental_health_population.chk"; // their last merged totals
+const int64_t AGGREGATE_MERGE_SECONDS = 1;
+const string THOUGHT_INDEX_FILE = "thought_index.bin";
+const string ARCHIVE_FILE = "history_archive.bin";
+const string ARCHIVE_INDEX_FILE = "history_archive.idx";
+const size_t MAX_PAGE_SIZE = 200;        // entries per history page, whatever PAGE_SIZE or size= ask for
+const size_t MAX_SEARCH_RESULTS = 20;
+const string DATA_DIR = "mental_health_data";
+const string SESSION_COOKIE = "mhs_session";
+const size_t MAX_FORM_BODY_BYTES = 8 * 1024 * 1024;
+const size_t IMPORT_BATCH_ENTRIES = 5000;       // records applied per committed snapshot
+const size_t IMPORT_MAX_RECORD_BYTES = 1024 * 1024;
+const size_t EXPORT_CHUNK_BYTES = 64 * 1024;
+const size_t HOT_STATE_CAPACITY = 4096; // users kept in memory in server mode
+const chrono::microseconds GROUP_COMMIT_WINDOW(1000); // server mode: how long a log record waits for others to share its sync
+const string_view STATE_UNREADABLE_MESSAGE = "Your saved data could not be read, so nothing was changed. "
+                                             "Please contact the site administrator.\n";
+const string_view SAVE_FAILED_MESSAGE = "Your change could not be saved. Please try again later.\n";
+const string_view IMPORT_NEEDS_POST_MESSAGE = "An import reads its records from a POST body.\n";
+
+// The moods the app knows about. A mood's id is its index in this table;
+// state, snapshots and the page all work with ids and only names cross the
+// boundary (form input, log records, snapshot strings).
+struct MoodInfo {
+    string_view name;
+    string_view emoji;
+};
+
+typedef uint8_t MoodId;
+
+constexpr MoodInfo MOODS[] = {
+    {"Happy", "😊"},
+    {"Sad", "😢"},
+    {"Anxious", "😰"},
+    {"Angry", "😠"},
+    {"Tired", "😴"},
+    {"Stressed", "😫"},
+    {"Neutral", "😐"},
+    {"Excited", "😃"},
+    {"Calm", "😌"}
+};
+constexpr size_t MOOD_COUNT = sizeof(MOODS) / sizeof(MOODS[0]);
+constexpr MoodId UNKNOWN_MOOD = 0xFF;
+constexpr MoodId NEUTRAL_MOOD = 6;
+
+typedef array<uint32_t, MOOD_COUNT> MoodCounts; // indexed by MoodId
+
+// Name -> id through a perfect hash: FNV-1a, then a multiplier chosen at
+// compile time so every mood lands in its own slot (top bits of the product).
+constexpr unsigned MOOD_HASH_BITS = 5;
+constexpr size_t MOOD_HASH_SLOTS = size_t(1) << MOOD_HASH_BITS;
+
+constexpr uint32_t moodHash(string_view name, uint32_t seed) {
+    uint32_t h = 2166136261u;
+    for (char c : name) {
+        h ^= (uint8_t)c;
+        h *= 16777619u;
+    }
+    return (uint32_t)(h * (2 * seed + 1)) >> (32 - MOOD_HASH_BITS);
+}
+
+constexpr uint32_t findMoodHashSeed() {
+    for (uint32_t seed = 0;; seed++) {
+        bool used[MOOD_HASH_SLOTS] = {};
+        bool collision = false;
+        for (size_t i = 0; i < MOOD_COUNT && !collision; i++) {
+            uint32_t slot = moodHash(MOODS[i].name, seed);
+            collision = used[slot];
+            used[slot] = true;
+        }
+        if (!collision) return seed;
+    }
+}
+
+constexpr uint32_t MOOD_HASH_SEED = findMoodHashSeed();
+
+struct MoodSlots {
+    MoodId ids[MOOD_HASH_SLOTS];
+};
+
+constexpr MoodSlots buildMoodSlots() {
+    MoodSlots slots = {};
+    for (MoodId& id : slots.ids) id = UNKNOWN_MOOD;
+    for (size_t i = 0; i < MOOD_COUNT; i++) {
+        slots.ids[moodHash(MOODS[i].name, MOOD_HASH_SEED)] = (MoodId)i;
+    }
+    return slots;
+}
+
+constexpr MoodSlots MOOD_SLOTS = buildMoodSlots();
+
+// UNKNOWN_MOOD for anything not in MOODS (bad form input, damaged state)
+constexpr MoodId moodIdFor(string_view name) {
+    MoodId id = MOOD_SLOTS.ids[moodHash(name, MOOD_HASH_SEED)];
+    return (id != UNKNOWN_MOOD && MOODS[id].name == name) ? id : UNKNOWN_MOOD;
+}
+
+static_assert(MOOD_COUNT < UNKNOWN_MOOD, "mood ids must fit in MoodId");
+static_assert(moodIdFor("Neutral") == NEUTRAL_MOOD, "NEUTRAL_MOOD out of sync with MOODS");
+static_assert(moodIdFor("Calm") == 8 && moodIdFor("Bored") == UNKNOWN_MOOD, "mood hash is not perfect");
+
+string_view moodName(MoodId id) {
+    return id < MOOD_COUNT ? MOODS[id].name : "Unknown";
+}
+
+string_view moodEmoji(MoodId id) {
+    return id < MOOD_COUNT ? MOODS[id].emoji : "❔";
+}
+
+// Day number in local time; weeks start on Monday (day 0 was a Thursday).
+int32_t localDay(time_t when) {
+    tm local;
+    localtime_r(&when, &local);
+    return (int32_t)((when + local.tm_gmtoff) / 86400);
+}
+
+int32_t weekOfDay(int32_t day) {
+    return (day + 3) >= 0 ? (day + 3) / 7 : (day + 3 - 6) / 7;
+}
+
+// Fixed-capacity FIFO, indexed oldest first. Once full, push_back overwrites
+// the oldest element in O(1) and hands it back instead of shifting the rest.
+// Until a capacity is set (0) it grows like a vector, so state can be loaded
+// before the configured history length is known.
+template <typename T>
+class RingBuffer {
+public:
+    size_t size() const { return slots.size(); }
+    bool empty() const { return slots.empty(); }
+    
+    const T& operator[](size_t i) const { return slots[(head + i) % slots.size()]; }
+    T& operator[](size_t i) { return slots[(head + i) % slots.size()]; }
+    
+    // Returns true if the buffer was full; the displaced element goes to 'evicted'
+    bool push_back(T value, T* evicted = nullptr) {
+        if (limit == 0 || slots.size() < limit) {
+            slots.push_back(move(value));
+            return false;
+        }
+        if (evicted != nullptr) *evicted = move(slots[head]);
+        slots[head] = move(value);
+        head = (head + 1) % limit;
+        return true;
+    }
+    
+    // Keeps the newest 'capacity' elements (at least 1); older ones are
+    // appended to 'evicted', oldest first.
+    void setCapacity(size_t capacity, vector<T>& evicted) {
+        capacity = max<size_t>(capacity, 1);
+        vector<T> ordered;
+        ordered.reserve(min(slots.size(), capacity));
+        size_t drop = slots.size() > capacity ? slots.size() - capacity : 0;
+        for (size_t i = 0; i < slots.size(); i++) {
+            if (i < drop) evicted.push_back(move((*this)[i]));
+            else ordered.push_back(move((*this)[i]));
+        }
+        slots.swap(ordered);
+        head = 0;
+        limit = capacity;
+    }
+    
+private:
+    vector<T> slots;
+    size_t head = 0;  // index of the oldest element once the buffer is full
+    size_t limit = 0; // 0 = not sized yet
+};
+
+// A mood event by id: events are numbered 1, 2, 3... as they are logged.
+struct MoodEvent {
+    unsigned long long id;
+    int64_t time;
+    MoodId mood;
+};
+
+// Every logged mood with its time, stored column-wise, plus per-day and
+// per-week counts, rolling 7/30-day windows and logging streaks that are
+// updated as each event arrives. Windowed views therefore cost at most one
+// bucket lookup per day of the window, whatever the length of the history.
+// Only the newest events are kept in memory (older ones move to the history
+// archive); the aggregates cover all of them.
+struct MoodSeries {
+    RingBuffer<int64_t> times; // event columns, oldest first; time 0 = unknown (migrated)
+    RingBuffer<MoodId> moods;
+    RingBuffer<uint64_t> versions; // state version that logged each event; 0 = unknown
+    unsigned long long eventsRecorded = 0; // id of the newest event
+    
+    map<int32_t, MoodCounts> dayCounts;  // local day -> count per mood
+    map<int32_t, MoodCounts> weekCounts; // week -> count per mood
+    int32_t windowDay = 0;               // last day covered by the rolling windows
+    MoodCounts last7 = {};
+    MoodCounts last30 = {};
+    
+    int32_t lastLogDay = 0; // 0 = never
+    int32_t currentStreak = 0;
+    int32_t longestStreak = 0;
+    
+    size_t size() const { return times.size(); }
+    
+    static void add(MoodCounts& counts, const MoodCounts& delta) {
+        for (size_t id = 0; id < MOOD_COUNT; id++) counts[id] += delta[id];
+    }
+    
+    static void subtract(MoodCounts& counts, const MoodCounts& delta) {
+        for (size_t id = 0; id < MOOD_COUNT; id++) counts[id] -= delta[id];
+    }
+    
+    // Drops days that fell out of 'window' if it ended on windowDay and now ends on 'day'
+    void expire(MoodCounts& window, int span, int32_t day) const {
+        if (day - windowDay >= span) {
+            window.fill(0);
+            return;
+        }
+        for (int32_t d = windowDay - span + 1; d <= day - span; d++) {
+            auto it = dayCounts.find(d);
+            if (it != dayCounts.end()) subtract(window, it->second);
+        }
+    }
+    
+    // Counts one event in the aggregates (not the event columns)
+    void count(int32_t day, MoodId id) {
+        if (day > windowDay) {
+            expire(last7, 7, day);
+            expire(last30, 30, day);
+            windowDay = day;
+        }
+        dayCounts[day][id]++;
+        weekCounts[weekOfDay(day)][id]++;
+        if (day > windowDay - 7) last7[id]++;
+        if (day > windowDay - 30) last30[id]++;
+        
+        if (lastLogDay == 0 || day > lastLogDay + 1) {
+            currentStreak = 1;
+        } else if (day == lastLogDay + 1) {
+            currentStreak++;
+        }
+        if (day >= lastLogDay) lastLogDay = day;
+        longestStreak = max(longestStreak, currentStreak);
+    }
+    
+    // Events migrated from the old untimed history
+    void appendUntimed(MoodId id) {
+        times.push_back(0);
+        moods.push_back(id);
+        versions.push_back(0);
+        eventsRecorded++;
+    }
+    
+    // Returns true if the oldest kept event was pushed out into 'evicted'
+    bool record(time_t when, MoodId id, uint64_t version, MoodEvent& evicted) {
+        if (when > 0) count(localDay(when), id);
+        eventsRecorded++;
+        bool full = times.push_back(when, &evicted.time);
+        moods.push_back(id, &evicted.mood);
+        versions.push_back(version);
+        evicted.id = eventsRecorded - size();
+        return full;
+    }
+    
+    void setCapacity(size_t capacity, vector<MoodEvent>& evicted) {
+        unsigned long long firstId = eventsRecorded - size() + 1;
+        vector<int64_t> oldTimes;
+        vector<MoodId> oldMoods;
+        vector<uint64_t> oldVersions;
+        times.setCapacity(capacity, oldTimes);
+        moods.setCapacity(capacity, oldMoods);
+        versions.setCapacity(capacity, oldVersions);
+        for (size_t i = 0; i < oldTimes.size(); i++) {
+            evicted.push_back({firstId + i, oldTimes[i], oldMoods[i]});
+        }
+    }
+    
+    // Rebuilds weeks and rolling windows after the day buckets were loaded
+    void rebuildDerived() {
+        weekCounts.clear();
+        last7.fill(0);
+        last30.fill(0);
+        windowDay = dayCounts.empty() ? 0 : dayCounts.rbegin()->first;
+        for (const auto& day : dayCounts) {
+            add(weekCounts[weekOfDay(day.first)], day.second);
+            if (day.first > windowDay - 7) add(last7, day.second);
+            if (day.first > windowDay - 30) add(last30, day.second);
+        }
+    }
+    
+    // Counts per mood over the 'span' days ending today (span 7 or 30)
+    MoodCounts rolling(int span, int32_t today) const {
+        MoodCounts window = span == 7 ? last7 : last30;
+        if (today > windowDay) expire(window, span, today);
+        return window;
+    }
+    
+    MoodCounts bucket(const map<int32_t, MoodCounts>& buckets, int32_t key) const {
+        auto it = buckets.find(key);
+        return it == buckets.end() ? MoodCounts() : it->second;
+    }
+    
+    int32_t streakAsOf(int32_t today) const {
+        return (lastLogDay != 0 && today - lastLogDay <= 1) ? currentStreak : 0;
+    }
+};
+
+struct JournalEntry {
+    unsigned long long id;
+    string thought;
+    string timestamp;
+};
+
+const size_t MAX_STRATEGIES = 100000;
+
+// Coping strategies, each stored once. A strategy keeps its position for good,
+// so its id is position + 1. Lookups by text go through an open-addressing
+// table of positions, and suggestions are drawn from an alias table weighted
+// by how often each strategy was used.
+class StrategyStore {
+public:
+    struct Entry {
+        string text;
+        uint32_t uses = 0;
+        int64_t lastUsed = 0; // 0 = never
+    };
+    static constexpr size_t NOT_FOUND = SIZE_MAX;
+    
+    size_t size() const { return entries.size(); }
+    bool empty() const { return entries.empty(); }
+    const Entry& operator[](size_t i) const { return entries[i]; }
+    vector<Entry>::const_iterator begin() const { return entries.begin(); }
+    vector<Entry>::const_iterator end() const { return entries.end(); }
+    
+    size_t find(string_view text) const {
+        if (slots.empty()) return NOT_FOUND;
+        size_t mask = slots.size() - 1;
+        for (size_t i = hash<string_view>()(text) & mask; slots[i] != EMPTY_SLOT; i = (i + 1) & mask) {
+            if (entries[slots[i]].text == text) return slots[i];
+        }
+        return NOT_FOUND;
+    }
+    
+    // Returns false if the text is already stored or the store is full
+    bool add(string_view text, uint32_t uses = 0, int64_t lastUsed = 0) {
+        if (entries.size() >= MAX_STRATEGIES || find(text) != NOT_FOUND) return false;
+        if ((entries.size() + 1) * 2 > slots.size()) {
+            slots.assign(max<size_t>(16, slots.size() * 2), EMPTY_SLOT);
+            for (size_t i = 0; i < entries.size(); i++) insertSlot(i);
+        }
+        entries.push_back({string(text), uses, lastUsed});
+        insertSlot(entries.size() - 1);
+        if (uses > 0) tableStale = true;
+        else if (!tableStale) increments.push_back((uint32_t)(entries.size() - 1));
+        return true;
+    }
+    
+    void use(size_t position, int64_t when) {
+        Entry& entry = entries[position];
+        if (entry.uses < UINT32_MAX) entry.uses++;
+        entry.lastUsed = when;
+        if (!tableStale) increments.push_back((uint32_t)position);
+    }
+    
+    // Raises a stored strategy's counts to at least these, for an import of
+    // a strategy the user already has
+    void mergeUsage(size_t position, uint32_t uses, int64_t lastUsed) {
+        Entry& entry = entries[position];
+        if (uses > entry.uses) {
+            entry.uses = uses;
+            tableStale = true;
+        }
+        entry.lastUsed = max(entry.lastUsed, lastUsed);
+    }
+    
+    // Picks a position with probability proportional to uses + 1, so the
+    // strategies that got used come up more often and new ones still get a
+    // turn. Weights only grow, so everything added since the alias table was
+    // built sits in 'increments', one slot per unit of weight, and is drawn
+    // from there. The O(n) rebuild waits until there are as many increments
+    // as strategies, which keeps a pick O(1) amortized and exactly weighted.
+    template <typename Random>
+    size_t sample(Random& random) const {
+        if (entries.empty()) return NOT_FOUND;
+        if (tableStale || increments.size() > max<size_t>(64, entries.size())) buildAliasTable();
+        uint64_t pick = uniform_int_distribution<uint64_t>(0, tableWeight + increments.size() - 1)(random);
+        if (pick >= tableWeight) return increments[pick - tableWeight];
+        size_t column = uniform_int_distribution<size_t>(0, alias.size() - 1)(random);
+        return uniform_real_distribution<double>(0, 1)(random) < aliasProbability[column] ? column : alias[column];
+    }
+    
+private:
+    static constexpr uint32_t EMPTY_SLOT = UINT32_MAX;
+    
+    void insertSlot(size_t position) {
+        size_t mask = slots.size() - 1;
+        size_t i = hash<string_view>()(entries[position].text) & mask;
+        while (slots[i] != EMPTY_SLOT) i = (i + 1) & mask;
+        slots[i] = (uint32_t)position;
+    }
+    
+    // Vose's method: every column holds one strategy's share and, if that
+    // is short of a full column, the rest goes to an alias
+    void buildAliasTable() const {
+        size_t n = entries.size();
+        tableWeight = 0;
+        for (const Entry& entry : entries) tableWeight += entry.uses + 1ULL;
+        aliasProbability.resize(n);
+        alias.assign(n, 0);
+        vector<uint32_t> small, large;
+        for (size_t i = 0; i < n; i++) {
+            aliasProbability[i] = (entries[i].uses + 1.0) * n / tableWeight;
+            (aliasProbability[i] < 1 ? small : large).push_back((uint32_t)i);
+        }
+        while (!small.empty() && !large.empty()) {
+            uint32_t low = small.back();
+            uint32_t high = large.back();
+            small.pop_back();
+            alias[low] = high;
+            aliasProbability[high] -= 1 - aliasProbability[low];
+            if (aliasProbability[high] < 1) {
+                large.pop_back();
+                small.push_back(high);
+            }
+        }
+        // Whatever is left is a full column, up to rounding
+        for (uint32_t i : large) aliasProbability[i] = 1;
+        for (uint32_t i : small) aliasProbability[i] = 1;
+        increments.clear();
+        tableStale = false;
+    }
+    
+    vector<Entry> entries;
+    vector<uint32_t> slots; // positions by text hash, linear probing, at most half full
+    
+    // Sampler, built on the first suggestion
+    mutable vector<double> aliasProbability;
+    mutable vector<uint32_t> alias;
+    mutable uint64_t tableWeight = 0;
+    mutable vector<uint32_t> increments; // one position per unit of weight added since the build
+    mutable bool tableStale = true;
+};
 
 struct MentalHealthState {
-    vector<string> moodHistory;
-    vector<pair<string, string>> thoughtJournal; // thought + timestamp
-    deque<string> copingStrategies;
-    string currentMood;
+    MoodSeries moodHistory;
+    RingBuffer<pair<string, string>> thoughtJournal; // thought + timestamp
+    RingBuffer<uint64_t> thoughtVersions;            // state version that wrote each entry; 0 = unknown
+    // Suggesting a strategy moves strategyCursor instead of the list
+    StrategyStore copingStrategies;
+    size_t strategyCursor = 0;                       // position of the current suggestion
+    unsigned long long strategiesVersion = 0;        // last version that added or suggested a strategy
+    MoodId currentMood = NEUTRAL_MOOD;
+    int64_t currentMoodTime = 0; // when currentMood was logged; 0 = unknown
     string lastStrategyUsed;
-    time_t lastStrategyTime;
-    map<string, int> moodStatistics;
+    time_t lastStrategyTime = 0;
+    MoodCounts moodStatistics = {};
+    unsigned long long version = 0; // bumped by every mutation; equals the last log record applied
+    
+    // Journal entries are numbered 1, 2, 3... in the order they were written;
+    // thoughtJournal.back() has id thoughtsRecorded.
+    unsigned long long thoughtsRecorded = 0;
+    // Thoughts not yet in the on-disk search index (id, text). Rebuilt from
+    // the log on load and folded into the index at compaction.
+    vector<pair<unsigned long long, string>> unindexedThoughts;
+    
+    // Entries pushed out of the history rings, waiting to be appended to the
+    // archive at the next compaction. Also rebuilt from the log on load.
+    vector<MoodEvent> unarchivedMoods;
+    vector<JournalEntry> unarchivedThoughts;
+};
+
+struct AppConfig {
+    vector<string> defaultStrategies;
+    int maxHistoryItems;
+    int pageSize; // entries per history page
+    bool enableTimestamps;
+    vector<MoodId> offeredMoods; // the mood form's options, in order
+    array<string, MOOD_COUNT> moodEmojis;
+    string adminToken; // unlocks action=population; empty = that action is off
+    long long stamp = 0;     // mtime (ns) of the file it was read from, 0 = defaults
+    uint64_t generation = 0; // bumped each time the file is read again
+};
+
+// ---------------------------------------------------------------------------
+// Per-user storage
+//
+// Every visitor gets a random session id in the mhs_session cookie. Their
+// files live in DATA_DIR/<shard>/<session>/, where the shard is a hash of the
+// id so no single directory grows too large. Concurrent CGI processes for the
+// same user serialize on an flock() of that directory's lock file.
+// ---------------------------------------------------------------------------
+
+struct StatePaths {
+    string dir;
+    string snapshot;
+    string legacyText;
+    string log;
+    string compactingLog;
+    string lock;
+    string thoughtIndex;
+    string archive;
+    string archiveIndex;
+};
+
+StatePaths statePathsIn(const string& dir) {
+    string prefix = dir.empty() ? "" : dir + "/";
+    StatePaths paths;
+    paths.dir = dir;
+    paths.snapshot = prefix + SNAPSHOT_FILE;
+    paths.legacyText = prefix + STATE_FILE;
+    paths.log = prefix + LOG_FILE;
+    paths.compactingLog = prefix + COMPACTING_LOG_FILE;
+    paths.lock = prefix + LOCK_FILE;
+    paths.thoughtIndex = prefix + THOUGHT_INDEX_FILE;
+    paths.archive = prefix + ARCHIVE_FILE;
+    paths.archiveIndex = prefix + ARCHIVE_INDEX_FILE;
+    return paths;
+}
+
+uint32_t hashSessionId(const string& session) {
+    uint32_t hash = 2166136261u; // FNV-1a
+    for (unsigned char c : session) {
+        hash = (hash ^ c) * 16777619u;
+    }
+    return hash;
+}
+
+bool isValidSessionId(const string& session) {
+    if (session.size() != 32) return false;
+    for (char c : session) {
+        if (!isxdigit((unsigned char)c) || isupper((unsigned char)c)) return false;
+    }
+    return true;
+}
+
+string newSessionId() {
+    // random_device is not safe to share between the server's threads
+    thread_local random_device rd;
+    static const char hex[] = "0123456789abcdef";
+    string session;
+    for (int i = 0; i < 4; i++) {
+        uint32_t bits = rd();
+        for (int j = 0; j < 8; j++) {
+            session += hex[bits & 0xf];
+            bits >>= 4;
+        }
+    }
+    return session;
+}
+
+// Extracts a well-formed session id from a Cookie header, or "" if none.
+string sessionFromCookies(const string& cookies) {
+    string key = SESSION_COOKIE + "=";
+    size_t pos = 0;
+    while (pos < cookies.size()) {
+        size_t end = cookies.find(';', pos);
+        if (end == string::npos) end = cookies.size();
+        size_t start = cookies.find_first_not_of(' ', pos);
+        if (start < end && cookies.compare(start, key.size(), key) == 0) {
+            string value = cookies.substr(start + key.size(), end - start - key.size());
+            if (isValidSessionId(value)) return value;
+        }
+        pos = end + 1;
+    }
+    return "";
+}
+
+string sessionCookieHeader(const string& session) {
+    return "Set-Cookie: " + SESSION_COOKIE + "=" + session + "; Path=/; Max-Age=31536000; HttpOnly; SameSite=Lax\r\n";
+}
+
+string userStateDir(const string& session) {
+    char shard[3];
+    snprintf(shard, sizeof(shard), "%02x", hashSessionId(session) & 0xff);
+    return DATA_DIR + "/" + shard + "/" + session;
+}
+
+// State files from the single-user layout, sitting in the working directory
+bool hasLegacyState() {
+    return access(SNAPSHOT_FILE.c_str(), F_OK) == 0 || access(STATE_FILE.c_str(), F_OK) == 0 ||
+           access(LOG_FILE.c_str(), F_OK) == 0;
+}
+
+// Creates the user's directory. Whoever creates DATA_DIR itself is the first
+// visitor after the upgrade to per-user state and inherits the old
+// single-user files.
+bool ensureUserStateDir(const string& session) {
+    bool createdDataDir = mkdir(DATA_DIR.c_str(), 0755) == 0;
+    string dir = userStateDir(session);
+    mkdir(dir.substr(0, dir.rfind('/')).c_str(), 0755);
+    if (mkdir(dir.c_str(), 0755) != 0 && errno != EEXIST) return false;
+    
+    if (createdDataDir) {
+        StatePaths paths = statePathsIn(dir);
+        rename(SNAPSHOT_FILE.c_str(), paths.snapshot.c_str());
+        rename(STATE_FILE.c_str(), paths.legacyText.c_str());
+        rename(LOG_FILE.c_str(), paths.log.c_str());
+        rename(COMPACTING_LOG_FILE.c_str(), paths.compactingLog.c_str());
+    }
+    return true;
+}
+
+// Takes an flock() on the user's lock file (LOCK_SH or LOCK_EX). Returns the
+// descriptor to close when done, or -1 if the user has no directory yet.
+int lockUserState(const StatePaths& paths, int mode) {
+    int fd = open(paths.lock.c_str(), O_RDWR | O_CREAT, 0644);
+    if (fd < 0) return -1;
+    while (flock(fd, mode) != 0) {
+        if (errno != EINTR) {
+            close(fd);
+            return -1;
+        }
+    }
+    return fd;
+}
+
+// ---------------------------------------------------------------------------
+// Binary snapshot
+//
+// The snapshot is a single file that is mmap()ed and read in place:
+//
+//   SnapshotHeader | SnapshotSection[sectionCount] | tables ... | string arena
+//
+// Every table is a plain array of fixed-size records; strings inside them are
+// (offset, length) references into the arena, handed out as string_views.
+// Readers skip sections they do not know and use each section's entrySize as
+// the stride, so newer writers can add sections or grow records without
+// breaking older readers. Incompatible changes bump SNAPSHOT_FORMAT_VERSION.
+// ---------------------------------------------------------------------------
+
+const char SNAPSHOT_MAGIC[8] = {'M', 'H', 'S', 'N', 'A', 'P', '\r', '\n'};
+const uint32_t SNAPSHOT_FORMAT_VERSION = 1;
+
+struct StringRef {
+    uint32_t offset;
+    uint32_t length;
+};
+
+struct SnapshotHeader {
+    char magic[8];
+    uint32_t formatVersion;
+    uint32_t sectionCount;
+    uint64_t fileSize;
+    uint64_t version;
+    int64_t lastStrategyTime;
+    StringRef currentMood;
+    StringRef lastStrategyUsed;
+};
+
+struct SnapshotSection {
+    uint32_t id;
+    uint32_t entrySize;
+    uint64_t offset;
+    uint64_t count;
+};
+
+enum SnapshotSectionId : uint32_t {
+    SECTION_STRING_ARENA = 1,    // raw bytes
+    SECTION_MOOD_STATS = 2,      // MoodStatRecord
+    SECTION_MOOD_HISTORY = 3,    // StringRef
+    SECTION_THOUGHT_JOURNAL = 4, // ThoughtRecord
+    SECTION_STRATEGIES = 5,      // StringRef
+    SECTION_TOTALS = 6,          // SnapshotTotals (one record)
+    SECTION_MOOD_NAMES = 7,      // StringRef, indexed by mood code
+    SECTION_MOOD_EVENT_TIMES = 8,// int64_t, one per mood event
+    SECTION_MOOD_EVENT_CODES = 9,// uint16_t, one per mood event
+    SECTION_MOOD_DAY_COUNTS = 10,// DayCountRecord
+    SECTION_MOOD_EVENT_VERSIONS = 11, // uint64_t, one per mood event
+    SECTION_THOUGHT_VERSIONS = 12,    // uint64_t, one per journal entry
+    SECTION_STRATEGY_USAGE = 13,      // StrategyUsageRecord, one per strategy
+    SECTION_INDEX_TERMS = 16,    // IndexTermRecord, sorted by term (thought index file)
+    SECTION_INDEX_POSTINGS = 17, // uint32_t thought ids (thought index file)
+    SECTION_ID_LIMIT
+};
+
+struct MoodStatRecord {
+    StringRef mood;
+    int64_t count;
+};
+
+struct ThoughtRecord {
+    StringRef thought;
+    StringRef timestamp;
+};
+
+// Counters that belong to the state as a whole. New fields go at the end;
+// readers zero-fill fields an older writer did not have.
+struct SnapshotTotals {
+    uint64_t thoughtsRecorded;
+    int32_t lastLogDay;
+    int32_t currentStreak;
+    int32_t longestStreak;
+    int32_t reserved;
+    uint64_t moodsRecorded;
+    uint64_t strategiesVersion;
+    uint64_t strategyCursor;
+    int64_t currentMoodTime;
+};
+
+struct StrategyUsageRecord {
+    uint32_t uses;
+    uint32_t reserved;
+    int64_t lastUsed;
+};
+
+struct DayCountRecord {
+    int32_t day;
+    uint16_t mood;
+    uint16_t reserved;
+    uint32_t count;
+};
+
+static_assert(sizeof(SnapshotHeader) == 56, "snapshot header layout changed");
+static_assert(sizeof(SnapshotSection) == 24, "snapshot section layout changed");
+
+class SnapshotView {
+public:
+    SnapshotView() {}
+    ~SnapshotView() { release(); }
+    SnapshotView(const SnapshotView&) = delete;
+    SnapshotView& operator=(const SnapshotView&) = delete;
+    
+    // Maps the file and validates the header and section table. Individual
+    // string references are bounds-checked when they are read.
+    bool open(const string& path) {
+        release();
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) return false;
+        struct stat st;
+        if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(SnapshotHeader)) {
+            ::close(fd);
+            return false;
+        }
+        void* mapped = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        ::close(fd);
+        if (mapped == MAP_FAILED) return false;
+        base = static_cast<const char*>(mapped);
+        size = st.st_size;
+        
+        header = reinterpret_cast<const SnapshotHeader*>(base);
+        if (memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) != 0 ||
+            header->formatVersion != SNAPSHOT_FORMAT_VERSION ||
+            header->fileSize != size ||
+            header->sectionCount > (size - sizeof(SnapshotHeader)) / sizeof(SnapshotSection)) {
+            release();
+            return false;
+        }
+        
+        const SnapshotSection* directory = reinterpret_cast<const SnapshotSection*>(base + sizeof(SnapshotHeader));
+        for (uint32_t i = 0; i < header->sectionCount; i++) {
+            const SnapshotSection& section = directory[i];
+            if (section.offset > size || section.offset % 8 != 0 || section.entrySize == 0 ||
+                section.count > (size - section.offset) / section.entrySize) {
+                release();
+                return false;
+            }
+            if (section.id < SECTION_ID_LIMIT) sections[section.id] = &section;
+        }
+        
+        const SnapshotSection* arenaSection = sections[SECTION_STRING_ARENA];
+        if (arenaSection != NULL) {
+            arena = base + arenaSection->offset;
+            arenaSize = arenaSection->count;
+        }
+        return true;
+    }
+    
+    void release() {
+        if (base != NULL) munmap(const_cast<char*>(base), size);
+        base = NULL;
+        size = 0;
+        header = NULL;
+        arena = NULL;
+        arenaSize = 0;
+        fill(begin(sections), end(sections), nullptr);
+    }
+    
+    uint64_t version() const { return header->version; }
+    time_t lastStrategyTime() const { return (time_t)header->lastStrategyTime; }
+    string_view currentMood() const { return str(header->currentMood); }
+    string_view lastStrategyUsed() const { return str(header->lastStrategyUsed); }
+    
+    size_t moodStatCount() const { return count(SECTION_MOOD_STATS, sizeof(MoodStatRecord)); }
+    string_view moodStatName(size_t i) const { return str(record<MoodStatRecord>(SECTION_MOOD_STATS, i).mood); }
+    long long moodStatValue(size_t i) const { return record<MoodStatRecord>(SECTION_MOOD_STATS, i).count; }
+    
+    size_t moodHistoryCount() const { return count(SECTION_MOOD_HISTORY, sizeof(StringRef)); }
+    string_view moodHistory(size_t i) const { return str(record<StringRef>(SECTION_MOOD_HISTORY, i)); }
+    
+    size_t thoughtCount() const { return count(SECTION_THOUGHT_JOURNAL, sizeof(ThoughtRecord)); }
+    string_view thought(size_t i) const { return str(record<ThoughtRecord>(SECTION_THOUGHT_JOURNAL, i).thought); }
+    string_view thoughtTimestamp(size_t i) const { return str(record<ThoughtRecord>(SECTION_THOUGHT_JOURNAL, i).timestamp); }
+    
+    size_t strategyCount() const { return count(SECTION_STRATEGIES, sizeof(StringRef)); }
+    string_view strategy(size_t i) const { return str(record<StringRef>(SECTION_STRATEGIES, i)); }
+    
+    bool hasSection(uint32_t id) const { return sections[id] != NULL; }
+    
+    // Reads the single record of a section that may have grown over time
+    template <typename T>
+    T extensibleRecord(uint32_t id) const {
+        T value = {};
+        const SnapshotSection* section = sections[id];
+        if (section != NULL && section->count > 0) {
+            memcpy(&value, base + section->offset, min<size_t>(section->entrySize, sizeof(T)));
+        }
+        return value;
+    }
+    
+    // Generic table access for other files laid out by SnapshotWriter
+    template <typename T>
+    size_t tableSize(uint32_t id) const { return count(id, sizeof(T)); }
+    template <typename T>
+    const T& tableEntry(uint32_t id, size_t i) const { return record<T>(id, i); }
+    string_view text(StringRef ref) const { return str(ref); }
+    
+private:
+    const char* base = NULL;
+    size_t size = 0;
+    const SnapshotHeader* header = NULL;
+    const SnapshotSection* sections[SECTION_ID_LIMIT] = {};
+    const char* arena = NULL;
+    size_t arenaSize = 0;
+    
+    string_view str(StringRef ref) const {
+        if (arena == NULL || ref.offset > arenaSize || ref.length > arenaSize - ref.offset) return string_view();
+        return string_view(arena + ref.offset, ref.length);
+    }
+    
+    // Sections written with smaller records than this build expects are ignored
+    size_t count(uint32_t id, size_t recordSize) const {
+        const SnapshotSection* section = sections[id];
+        return (section != NULL && section->entrySize >= recordSize) ? section->count : 0;
+    }
+    
+    template <typename T>
+    const T& record(uint32_t id, size_t i) const {
+        const SnapshotSection* section = sections[id];
+        return *reinterpret_cast<const T*>(base + section->offset + i * section->entrySize);
+    }
+};
+
+// Collects tables and strings for a snapshot and lays them out in one buffer.
+struct SnapshotWriter {
+    string arena;
+    vector<pair<uint32_t, pair<uint32_t, string>>> tables; // id -> (entrySize, bytes)
+    
+    StringRef addString(string_view s) {
+        StringRef ref = {(uint32_t)arena.size(), (uint32_t)s.size()};
+        arena.append(s.data(), s.size());
+        return ref;
+    }
+    
+    template <typename T>
+    void addRecord(uint32_t id, const T& record) {
+        addTable(id, vector<T>(1, record));
+    }
+    
+    template <typename T>
+    void addTable(uint32_t id, const vector<T>& records) {
+        tables.push_back({id, {(uint32_t)sizeof(T), string(reinterpret_cast<const char*>(records.data()), records.size() * sizeof(T))}});
+    }
+    
+    string finish(SnapshotHeader header) {
+        tables.push_back({SECTION_STRING_ARENA, {1, arena}});
+        
+        memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+        header.formatVersion = SNAPSHOT_FORMAT_VERSION;
+        header.sectionCount = tables.size();
+        
+        vector<SnapshotSection> directory;
+        size_t offset = sizeof(SnapshotHeader) + tables.size() * sizeof(SnapshotSection);
+        for (const auto& table : tables) {
+            offset = (offset + 7) & ~size_t(7);
+            const string& bytes = table.second.second;
+            directory.push_back({table.first, table.second.first, offset, bytes.size() / table.second.first});
+            offset += bytes.size();
+        }
+        header.fileSize = offset;
+        
+        string out;
+        out.reserve(offset);
+        out.append(reinterpret_cast<const char*>(&header), sizeof(header));
+        out.append(reinterpret_cast<const char*>(directory.data()), directory.size() * sizeof(SnapshotSection));
+        for (size_t i = 0; i < tables.size(); i++) {
+            out.resize(directory[i].offset, '\0');
+            out += tables[i].second.second;
+        }
+        return out;
+    }
 };
 
-struct AppConfig {
-    vector<string> availableMoods;
-    map<string, string> moodEmojis;
-    vector<string> defaultStrategies;
-    int maxHistoryItems;
-    bool enableTimestamps;
-};
+// Gives journal entries from an older snapshot or the text format their ids
+// and queues them for the search index.
+void numberUnindexedJournal(MentalHealthState& state) {
+    state.thoughtsRecorded = state.thoughtJournal.size();
+    for (size_t i = 0; i < state.thoughtJournal.size(); i++) {
+        state.unindexedThoughts.push_back({i + 1, state.thoughtJournal[i].first});
+    }
+}
+
+void initDefaultState(MentalHealthState& state) {
+    state.currentMood = NEUTRAL_MOOD;
+    state.lastStrategyUsed = "None yet";
+    state.lastStrategyTime = time(0);
+    
+    // Initialize mood statistics
+    state.moodStatistics[NEUTRAL_MOOD] = 1;
+}
+
+// Returns false if there is a snapshot but it cannot be read. The caller
+// must not carry on with defaults then, or the next save would replace the
+// user's data with them.
+bool loadState(const StatePaths& paths, MentalHealthState& state) {
+    SnapshotView snapshot;
+    
+    if (snapshot.open(paths.snapshot)) {
+        // Moods this build does not know are dropped rather than trusted
+        MoodId current = moodIdFor(snapshot.currentMood());
+        state.currentMood = current == UNKNOWN_MOOD ? NEUTRAL_MOOD : current;
+        state.lastStrategyUsed = string(snapshot.lastStrategyUsed());
+        state.lastStrategyTime = snapshot.lastStrategyTime();
+        state.version = snapshot.version();
+        
+        for (size_t i = 0; i < snapshot.moodStatCount(); i++) {
+            MoodId id = moodIdFor(snapshot.moodStatName(i));
+            if (id != UNKNOWN_MOOD) state.moodStatistics[id] = (uint32_t)snapshot.moodStatValue(i);
+        }
+        
+        MoodSeries& series = state.moodHistory;
+        if (snapshot.hasSection(SECTION_MOOD_EVENT_TIMES)) {
+            // Codes on disk index the snapshot's own name table
+            vector<MoodId> ids;
+            for (size_t i = 0; i < snapshot.tableSize<StringRef>(SECTION_MOOD_NAMES); i++) {
+                ids.push_back(moodIdFor(snapshot.text(snapshot.tableEntry<StringRef>(SECTION_MOOD_NAMES, i))));
+            }
+            size_t events = min(snapshot.tableSize<int64_t>(SECTION_MOOD_EVENT_TIMES),
+                                snapshot.tableSize<uint16_t>(SECTION_MOOD_EVENT_CODES));
+            bool versioned = snapshot.tableSize<uint64_t>(SECTION_MOOD_EVENT_VERSIONS) == events;
+            for (size_t i = 0; i < events; i++) {
+                uint16_t code = snapshot.tableEntry<uint16_t>(SECTION_MOOD_EVENT_CODES, i);
+                if (code >= ids.size() || ids[code] == UNKNOWN_MOOD) continue;
+                series.times.push_back(snapshot.tableEntry<int64_t>(SECTION_MOOD_EVENT_TIMES, i));
+                series.moods.push_back(ids[code]);
+                series.versions.push_back(versioned ? snapshot.tableEntry<uint64_t>(SECTION_MOOD_EVENT_VERSIONS, i) : 0);
+            }
+            for (size_t i = 0; i < snapshot.tableSize<DayCountRecord>(SECTION_MOOD_DAY_COUNTS); i++) {
+                const DayCountRecord& bucket = snapshot.tableEntry<DayCountRecord>(SECTION_MOOD_DAY_COUNTS, i);
+                if (bucket.mood >= ids.size() || ids[bucket.mood] == UNKNOWN_MOOD) continue;
+                series.dayCounts[bucket.day][ids[bucket.mood]] += bucket.count;
+            }
+            series.rebuildDerived();
+        } else {
+            // Untimed history from an older snapshot
+            for (size_t i = 0; i < snapshot.moodHistoryCount(); i++) {
+                MoodId id = moodIdFor(snapshot.moodHistory(i));
+                if (id != UNKNOWN_MOOD) series.appendUntimed(id);
+            }
+        }
+        
+        bool thoughtsVersioned = snapshot.tableSize<uint64_t>(SECTION_THOUGHT_VERSIONS) == snapshot.thoughtCount();
+        for (size_t i = 0; i < snapshot.thoughtCount(); i++) {
+            state.thoughtJournal.push_back({string(snapshot.thought(i)), string(snapshot.thoughtTimestamp(i))});
+            state.thoughtVersions.push_back(thoughtsVersioned ? snapshot.tableEntry<uint64_t>(SECTION_THOUGHT_VERSIONS, i) : 0);
+        }
+        
+        // Older snapshots may repeat a strategy; the store keeps the first copy
+        bool strategiesCounted = snapshot.tableSize<StrategyUsageRecord>(SECTION_STRATEGY_USAGE) == snapshot.strategyCount();
+        for (size_t i = 0; i < snapshot.strategyCount(); i++) {
+            StrategyUsageRecord usage = {};
+            if (strategiesCounted) usage = snapshot.tableEntry<StrategyUsageRecord>(SECTION_STRATEGY_USAGE, i);
+            state.copingStrategies.add(snapshot.strategy(i), usage.uses, usage.lastUsed);
+        }
+        
+        if (snapshot.hasSection(SECTION_TOTALS)) {
+            SnapshotTotals totals = snapshot.extensibleRecord<SnapshotTotals>(SECTION_TOTALS);
+            state.thoughtsRecorded = totals.thoughtsRecorded;
+            series.lastLogDay = totals.lastLogDay;
+            series.currentStreak = totals.currentStreak;
+            series.longestStreak = totals.longestStreak;
+            // Snapshots from before the archive did not number mood events
+            series.eventsRecorded = max<unsigned long long>(totals.moodsRecorded, series.size());
+            state.strategiesVersion = totals.strategiesVersion;
+            state.strategyCursor = totals.strategyCursor < state.copingStrategies.size() ? totals.strategyCursor : 0;
+            state.currentMoodTime = totals.currentMoodTime;
+            // Older snapshots don't have it; the newest event in memory is the best guess
+            for (size_t i = 0; state.currentMoodTime == 0 && i < series.size(); i++) {
+                state.currentMoodTime = max<int64_t>(state.currentMoodTime, series.times[i]);
+            }
+        } else {
+            // Written before thoughts were numbered or indexed
+            numberUnindexedJournal(state);
+        }
+    } else if (access(paths.snapshot.c_str(), F_OK) == 0) {
+        cerr << "Cannot read " << paths.snapshot << "; leaving it untouched" << endl;
+        return false;
+    } else {
+        // Initialize with default data if no state file exists
+        initDefaultState(state);
+    }
+    
+    return true;
+}
+
+// The text after "KEY: " in a line of the legacy format, "" if there is none
+string_view legacyValue(const string& line) {
+    size_t colon = line.find(':');
+    if (colon == string::npos) return string_view();
+    return string_view(line).substr(min(colon + 2, line.size()));
+}
+
+// A whole number from 0 to 'max'. Anything else, a damaged or truncated line
+// included, returns false and the line is skipped.
+bool parseLegacyNumber(string_view text, unsigned long long max, unsigned long long& out) {
+    string digits(text);
+    if (digits.empty() || !isdigit((unsigned char)digits[0])) return false;
+    char* end = NULL;
+    errno = 0;
+    unsigned long long parsed = strtoull(digits.c_str(), &end, 10);
+    if (errno == ERANGE || *end != '\0' || parsed > max) return false;
+    out = parsed;
+    return true;
+}
+
+// Reads the pre-snapshot text format (CURRENT_MOOD:/MOOD_STAT:/MOOD_HISTORY:...).
+// Only used once to migrate an existing STATE_FILE.
+bool loadLegacyState(const StatePaths& paths, MentalHealthState& state) {
+    ifstream file(paths.legacyText);
+    string line;
+    
+    if (!file.is_open()) return false;
+    
+    // Read current mood
+    getline(file, line);
+    if (line.find("CURRENT_MOOD:") != string::npos) {
+        MoodId current = moodIdFor(legacyValue(line));
+        if (current != UNKNOWN_MOOD) state.currentMood = current;
+    }
+    
+    // Read last strategy used
+    getline(file, line);
+    if (line.find("LAST_STRATEGY:") != string::npos) {
+        state.lastStrategyUsed = string(legacyValue(line));
+    }
+    
+    // Read last strategy time
+    getline(file, line);
+    unsigned long long number;
+    if (line.find("LAST_STRATEGY_TIME:") != string::npos && parseLegacyNumber(legacyValue(line), LLONG_MAX, number)) {
+        state.lastStrategyTime = (time_t)number;
+    }
+    
+    // Read mood statistics
+    while (getline(file, line) && line != "MOOD_HISTORY:") {
+        if (line.find("LOG_SEQUENCE:") != string::npos) {
+            if (parseLegacyNumber(legacyValue(line), ULLONG_MAX, number)) state.version = number;
+        } else if (line.find("MOOD_STAT:") != string::npos) {
+            string_view value = legacyValue(line);
+            size_t dash = value.find('-');
+            if (dash != string_view::npos && parseLegacyNumber(value.substr(dash + 1), UINT32_MAX, number)) {
+                MoodId mood = moodIdFor(value.substr(0, dash));
+                if (mood != UNKNOWN_MOOD) state.moodStatistics[mood] = (uint32_t)number;
+            }
+        }
+    }
+    
+    // Read mood history
+    while (getline(file, line) && line != "THOUGHT_JOURNAL:") {
+        MoodId mood = moodIdFor(line);
+        if (mood != UNKNOWN_MOOD) {
+            state.moodHistory.appendUntimed(mood);
+        }
+    }
+    
+    // Read thought journal
+    while (getline(file, line) && line != "COPING_STRATEGIES:") {
+        if (!line.empty()) {
+            // Check if line contains timestamp
+            size_t sep = line.find("|");
+            if (sep != string::npos) {
+                string thought = line.substr(0, sep);
+                string timestamp = line.substr(sep + 1);
+                state.thoughtJournal.push_back({thought, timestamp});
+            } else {
+                state.thoughtJournal.push_back({line, ""});
+            }
+        }
+    }
+    
+    // Read coping strategies
+    while (getline(file, line)) {
+        if (!line.empty()) {
+            state.copingStrategies.add(line);
+        }
+    }
+    
+    file.close();
+    numberUnindexedJournal(state);
+    return true;
+}
+
+// ---------------------------------------------------------------------------
+// Configuration
+//
+// CONFIG_FILE holds "KEY: value" lines; lines starting with '#' are comments.
+//   MAX_HISTORY: 50         entries kept in memory per history ring (1-100000)
+//   PAGE_SIZE: 20           entries per history page (1-200)
+//   TIMESTAMPS: 1           stamp journal entries (0 or 1)
+//   MOODS: Happy, Sad, Calm moods the form offers, in this order
+//   EMOJI: Happy = 😀       emoji shown for a mood
+//   STRATEGY: Go for a run  one per line; replaces the default strategies
+// Moods must be built-in names: ids of logged moods are stored in history
+// and snapshots. A line that does not validate is reported on stderr (the
+// web server's error log) and ignored. The parsed config is cached and only
+// read again when the file's inode, size or mtime changes.
+// ---------------------------------------------------------------------------
+
+const size_t MAX_STRATEGY_BYTES = 200;
+const size_t MAX_EMOJI_BYTES = 16;
+const size_t MIN_ADMIN_TOKEN_BYTES = 16;
+const size_t MAX_ADMIN_TOKEN_BYTES = 200;
+const uint64_t CONFIG_CHECK_INTERVAL_NS = 1000000000; // stat() the file at most once a second
+
+uint64_t monotonicNs() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+AppConfig defaultConfig() {
+    AppConfig config;
+    config.defaultStrategies = {
+        "Deep breathing for 5 minutes",
+        "Take a short walk outside",
+        "Write down three things you're grateful for",
+        "Listen to calming music",
+        "Practice mindfulness meditation",
+        "Drink a glass of water",
+        "Stretch your body",
+        "Read a book for 15 minutes",
+        "Call a friend or family member"
+    };
+    config.maxHistoryItems = 50;
+    config.pageSize = 20;
+    config.enableTimestamps = true;
+    for (size_t id = 0; id < MOOD_COUNT; id++) {
+        config.offeredMoods.push_back((MoodId)id);
+        config.moodEmojis[id] = string(MOODS[id].emoji);
+    }
+    return config;
+}
+
+string_view trimmed(string_view text) {
+    while (!text.empty() && isspace((unsigned char)text.front())) text.remove_prefix(1);
+    while (!text.empty() && isspace((unsigned char)text.back())) text.remove_suffix(1);
+    return text;
+}
+
+// Well-formed UTF-8 without control characters
+bool isCleanUtf8(string_view text) {
+    size_t i = 0;
+    while (i < text.size()) {
+        unsigned char c = text[i];
+        size_t extra = c < 0x80 ? 0 : (c >> 5) == 0x6 ? 1 : (c >> 4) == 0xE ? 2 : (c >> 3) == 0x1E ? 3 : 4;
+        if (extra == 4 || i + extra >= text.size()) return false;
+        if (c < 0x20 || c == 0x7F) return false;
+        for (size_t j = 1; j <= extra; j++) {
+            if (((unsigned char)text[i + j] >> 6) != 0x2) return false;
+        }
+        i += extra + 1;
+    }
+    return true;
+}
+
+bool parseConfigInt(string_view value, int lo, int hi, int& out) {
+    string digits(value);
+    char* end = NULL;
+    long parsed = strtol(digits.c_str(), &end, 10);
+    if (digits.empty() || *end != '\0' || parsed < lo || parsed > hi) return false;
+    out = (int)parsed;
+    return true;
+}
+
+AppConfig parseConfig(istream& file) {
+    AppConfig config = defaultConfig();
+    vector<string> strategies;
+    unordered_set<string> seenStrategies;
+    string line;
+    int lineNumber = 0;
+    auto reject = [&lineNumber](const string& why) {
+        cerr << CONFIG_FILE << ":" << lineNumber << ": " << why << ", line ignored" << endl;
+    };
+    
+    while (getline(file, line)) {
+        lineNumber++;
+        string_view text = trimmed(line);
+        if (text.empty() || text[0] == '#') continue;
+        size_t colon = text.find(':');
+        if (colon == string_view::npos) {
+            reject("expected KEY: value");
+            continue;
+        }
+        string_view key = trimmed(text.substr(0, colon));
+        string_view value = trimmed(text.substr(colon + 1));
+        
+        if (key == "MAX_HISTORY") {
+            if (!parseConfigInt(value, 1, 100000, config.maxHistoryItems)) reject("MAX_HISTORY must be 1-100000");
+        } else if (key == "PAGE_SIZE") {
+            if (!parseConfigInt(value, 1, (int)MAX_PAGE_SIZE, config.pageSize)) {
+                reject("PAGE_SIZE must be 1-" + to_string(MAX_PAGE_SIZE));
+            }
+        } else if (key == "TIMESTAMPS") {
+            if (value == "0" || value == "1") config.enableTimestamps = value == "1";
+            else reject("TIMESTAMPS must be 0 or 1");
+        } else if (key == "MOODS") {
+            vector<MoodId> moods;
+            bool valid = true;
+            while (valid && !value.empty()) {
+                size_t comma = value.find(',');
+                string_view name = trimmed(value.substr(0, comma));
+                value = comma == string_view::npos ? string_view() : value.substr(comma + 1);
+                MoodId id = moodIdFor(name);
+                valid = id != UNKNOWN_MOOD && find(moods.begin(), moods.end(), id) == moods.end();
+                moods.push_back(id);
+            }
+            if (valid && !moods.empty()) config.offeredMoods = moods;
+            else reject("MOODS must list distinct built-in moods");
+        } else if (key == "EMOJI") {
+            size_t equals = value.find('=');
+            MoodId id = equals == string_view::npos ? UNKNOWN_MOOD : moodIdFor(trimmed(value.substr(0, equals)));
+            string_view emoji = equals == string_view::npos ? string_view() : trimmed(value.substr(equals + 1));
+            if (id == UNKNOWN_MOOD) {
+                reject("EMOJI must be <built-in mood> = <emoji>");
+            } else if (emoji.empty() || emoji.size() > MAX_EMOJI_BYTES || !isCleanUtf8(emoji) ||
+                       emoji.find_first_of("<>&'\"") != string_view::npos) {
+                reject("EMOJI must be 1-" + to_string(MAX_EMOJI_BYTES) + " bytes of text without markup");
+            } else {
+                config.moodEmojis[id] = string(emoji);
+            }
+        } else if (key == "ADMIN_TOKEN") {
+            bool printable = all_of(value.begin(), value.end(), [](char c) { return c > ' ' && c < 0x7F; });
+            if (value.size() < MIN_ADMIN_TOKEN_BYTES || value.size() > MAX_ADMIN_TOKEN_BYTES || !printable) {
+                reject("ADMIN_TOKEN must be " + to_string(MIN_ADMIN_TOKEN_BYTES) + "-" + to_string(MAX_ADMIN_TOKEN_BYTES) +
+                       " printable characters without spaces");
+            } else {
+                config.adminToken = string(value);
+            }
+        } else if (key == "STRATEGY") {
+            if (value.empty() || value.size() > MAX_STRATEGY_BYTES || !isCleanUtf8(value)) {
+                reject("STRATEGY must be 1-" + to_string(MAX_STRATEGY_BYTES) + " bytes of text");
+            } else if (seenStrategies.insert(string(value)).second) {
+                strategies.emplace_back(value);
+            }
+        } else {
+            reject("unknown key");
+        }
+    }
+    if (!strategies.empty()) config.defaultStrategies = strategies;
+    return config;
+}
+
+struct ConfigCache {
+    mutex m;
+    shared_ptr<const AppConfig> config;
+    bool exists = false; // identity of the file 'config' was read from
+    dev_t device = 0;
+    ino_t inode = 0;
+    off_t size = 0;
+    timespec mtime = {};
+    uint64_t checkedNs = 0;
+};
+
+// The parsed CONFIG_FILE. Re-reads it only if it was replaced, edited,
+// created or removed since the last look; callers keep the returned
+// pointer for the rest of their request.
+shared_ptr<const AppConfig> currentConfig() {
+    static ConfigCache cache;
+    lock_guard<mutex> lock(cache.m);
+    uint64_t now = monotonicNs();
+    if (cache.config && now - cache.checkedNs < CONFIG_CHECK_INTERVAL_NS) return cache.config;
+    cache.checkedNs = now;
+    
+    struct stat st;
+    bool exists = stat(CONFIG_FILE.c_str(), &st) == 0;
+    if (cache.config && exists == cache.exists &&
+        (!exists || (st.st_dev == cache.device && st.st_ino == cache.inode && st.st_size == cache.size &&
+                     st.st_mtim.tv_sec == cache.mtime.tv_sec && st.st_mtim.tv_nsec == cache.mtime.tv_nsec))) {
+        return cache.config;
+    }
+    
+    ifstream file(CONFIG_FILE);
+    auto config = make_shared<AppConfig>(file.is_open() ? parseConfig(file) : defaultConfig());
+    config->stamp = exists ? (long long)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec : 0;
+    config->generation = cache.config ? cache.config->generation + 1 : 1;
+    cache.config = config;
+    cache.exists = exists;
+    if (exists) {
+        cache.device = st.st_dev;
+        cache.inode = st.st_ino;
+        cache.size = st.st_size;
+        cache.mtime = st.st_mtim;
+    }
+    return cache.config;
+}
+
+bool writeAll(int fd, const char* data, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        data += n;
+        len -= n;
+    }
+    return true;
+}
+
+// Writes a response head and body with as few syscalls as possible (one
+// writev() unless the kernel takes a partial write).
+bool writeResponse(int fd, const string& head, string_view body) {
+    iovec parts[2] = {{const_cast<char*>(head.data()), head.size()},
+                      {const_cast<char*>(body.data()), body.size()}};
+    size_t total = head.size() + body.size();
+    ssize_t n;
+    do {
+        n = writev(fd, parts, 2);
+    } while (n < 0 && errno == EINTR);
+    if (n < 0) return false;
+    if ((size_t)n == total) return true;
+    if ((size_t)n < head.size()) {
+        return writeAll(fd, head.data() + n, head.size() - n) && writeAll(fd, body.data(), body.size());
+    }
+    size_t bodyDone = n - head.size();
+    return writeAll(fd, body.data() + bodyDone, body.size() - bodyDone);
+}
+
+// Makes creates and renames in the directory durable
+bool syncDirectory(const string& dir) {
+    int fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+    if (fd < 0) return false;
+    bool ok = fsync(fd) == 0;
+    close(fd);
+    return ok;
+}
+
+string parentDirectory(const string& path) {
+    size_t slash = path.rfind('/');
+    return slash == string::npos ? "." : slash == 0 ? "/" : path.substr(0, slash);
+}
+
+// Writes 'bytes' to a temporary file and renames it over 'path'.
+// Readers see either the old file or the new one, never a mix. The data is
+// synced before the rename and the rename before returning, so after a
+// crash the file is the old version or the complete new one.
+bool replaceFile(const string& path, const string& bytes) {
+    string tmpFile = path + ".tmp";
+    int fd = open(tmpFile.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) return false;
+    bool ok = writeAll(fd, bytes.data(), bytes.size()) && fsync(fd) == 0;
+    ok = (close(fd) == 0) && ok;
+    if (!ok || rename(tmpFile.c_str(), path.c_str()) != 0) {
+        unlink(tmpFile.c_str());
+        return false;
+    }
+    return syncDirectory(parentDirectory(path));
+}
+
+// ---------------------------------------------------------------------------
+// Thought search index
+//
+// An inverted index from lower-cased terms to the ids of the journal entries
+// containing them, stored in the snapshot container format: a sorted term
+// table, one flat array of posting lists and the term strings in the arena.
+// The header's version field holds the highest thought id already indexed.
+// Lookups binary-search the mapped term table, so a query touches only the
+// terms and postings it needs. Thoughts written since the last compaction
+// are searched from MentalHealthState::unindexedThoughts.
+// ---------------------------------------------------------------------------
+
+struct IndexTermRecord {
+    StringRef term;
+    uint32_t postingOffset; // into SECTION_INDEX_POSTINGS
+    uint32_t postingCount;
+};
+
+// Calls visit(term) for every word in the text: runs of ASCII letters and
+// digits (lower-cased) or non-ASCII bytes, so UTF-8 words stay whole.
+template <typename Visitor>
+void forEachTerm(string_view text, Visitor visit) {
+    const size_t maxTermLength = 64;
+    string term;
+    for (size_t i = 0; i <= text.size(); i++) {
+        unsigned char c = i < text.size() ? text[i] : ' ';
+        if (isalnum(c) || c >= 0x80) {
+            if (term.size() < maxTermLength) term += (char)tolower(c);
+        } else if (!term.empty()) {
+            visit(term);
+            term.clear();
+        }
+    }
+}
+
+// Folds newly written thoughts into the index file (rewriting it merged).
+bool updateThoughtIndex(const StatePaths& paths, const vector<pair<unsigned long long, string>>& thoughts) {
+    map<string, vector<uint32_t>> postings;
+    uint64_t indexedThrough = 0;
+    
+    SnapshotView existing;
+    if (existing.open(paths.thoughtIndex)) {
+        indexedThrough = existing.version();
+        for (size_t i = 0; i < existing.tableSize<IndexTermRecord>(SECTION_INDEX_TERMS); i++) {
+            const IndexTermRecord& term = existing.tableEntry<IndexTermRecord>(SECTION_INDEX_TERMS, i);
+            size_t postingTotal = existing.tableSize<uint32_t>(SECTION_INDEX_POSTINGS);
+            if (term.postingOffset > postingTotal || term.postingCount > postingTotal - term.postingOffset) continue;
+            vector<uint32_t>& ids = postings[string(existing.text(term.term))];
+            for (uint32_t j = 0; j < term.postingCount; j++) {
+                ids.push_back(existing.tableEntry<uint32_t>(SECTION_INDEX_POSTINGS, term.postingOffset + j));
+            }
+        }
+    }
+    
+    uint64_t newIndexedThrough = indexedThrough;
+    for (const auto& thought : thoughts) {
+        // Already indexed by a compaction that died before its snapshot landed
+        if (thought.first <= indexedThrough) continue;
+        uint32_t id = (uint32_t)thought.first;
+        forEachTerm(thought.second, [&postings, id](const string& term) {
+            vector<uint32_t>& ids = postings[term];
+            if (ids.empty() || ids.back() != id) ids.push_back(id);
+        });
+        newIndexedThrough = max<uint64_t>(newIndexedThrough, thought.first);
+    }
+    if (newIndexedThrough == indexedThrough) return true;
+    
+    SnapshotWriter writer;
+    vector<IndexTermRecord> terms;
+    vector<uint32_t> allPostings;
+    terms.reserve(postings.size());
+    for (const auto& entry : postings) {
+        terms.push_back({writer.addString(entry.first), (uint32_t)allPostings.size(), (uint32_t)entry.second.size()});
+        allPostings.insert(allPostings.end(), entry.second.begin(), entry.second.end());
+    }
+    writer.addTable(SECTION_INDEX_TERMS, terms);
+    writer.addTable(SECTION_INDEX_POSTINGS, allPostings);
+    
+    SnapshotHeader header = {};
+    header.version = newIndexedThrough;
+    return replaceFile(paths.thoughtIndex, writer.finish(header));
+}
+
+// Ids of thoughts containing a term, or starting with it when 'prefix' is set.
+// Returned sorted and unique.
+vector<uint32_t> lookupTerm(const SnapshotView& index, const MentalHealthState& state, const string& term, bool prefix) {
+    vector<uint32_t> ids;
+    
+    size_t termCount = index.tableSize<IndexTermRecord>(SECTION_INDEX_TERMS);
+    size_t postingTotal = index.tableSize<uint32_t>(SECTION_INDEX_POSTINGS);
+    size_t lo = 0, hi = termCount;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (index.text(index.tableEntry<IndexTermRecord>(SECTION_INDEX_TERMS, mid).term) < term) lo = mid + 1;
+        else hi = mid;
+    }
+    for (size_t i = lo; i < termCount; i++) {
+        const IndexTermRecord& record = index.tableEntry<IndexTermRecord>(SECTION_INDEX_TERMS, i);
+        string_view candidate = index.text(record.term);
+        bool matches = prefix ? candidate.substr(0, term.size()) == term : candidate == term;
+        if (!matches) break;
+        if (record.postingOffset > postingTotal || record.postingCount > postingTotal - record.postingOffset) continue;
+        for (uint32_t j = 0; j < record.postingCount; j++) {
+            ids.push_back(index.tableEntry<uint32_t>(SECTION_INDEX_POSTINGS, record.postingOffset + j));
+        }
+    }
+    
+    for (const auto& thought : state.unindexedThoughts) {
+        bool found = false;
+        forEachTerm(thought.second, [&](const string& candidate) {
+            if (prefix ? candidate.compare(0, term.size(), term) == 0 : candidate == term) found = true;
+        });
+        if (found) ids.push_back((uint32_t)thought.first);
+    }
+    
+    sort(ids.begin(), ids.end());
+    ids.erase(unique(ids.begin(), ids.end()), ids.end());
+    return ids;
+}
+
+// All terms must match; a term ending in '*' matches as a prefix.
+// Returns up to 'limit' thought ids, newest first.
+vector<uint32_t> searchThoughts(const StatePaths& paths, const MentalHealthState& state, string_view query, size_t limit) {
+    vector<pair<string, bool>> terms;
+    size_t pos = 0;
+    while (pos < query.size()) {
+        size_t end = query.find(' ', pos);
+        if (end == string_view::npos) end = query.size();
+        string_view word = query.substr(pos, end - pos);
+        bool prefix = !word.empty() && word.back() == '*';
+        forEachTerm(word, [&terms, prefix](const string& term) { terms.push_back({term, false}); });
+        if (prefix && !terms.empty()) terms.back().second = true;
+        pos = end + 1;
+    }
+    if (terms.empty()) return {};
+    
+    SnapshotView index;
+    index.open(paths.thoughtIndex);
+    
+    vector<uint32_t> matches;
+    for (size_t i = 0; i < terms.size(); i++) {
+        vector<uint32_t> ids = lookupTerm(index, state, terms[i].first, terms[i].second);
+        if (i == 0) {
+            matches.swap(ids);
+        } else {
+            vector<uint32_t> both;
+            set_intersection(matches.begin(), matches.end(), ids.begin(), ids.end(), back_inserter(both));
+            matches.swap(both);
+        }
+        if (matches.empty()) break;
+    }
+    
+    reverse(matches.begin(), matches.end());
+    if (matches.size() > limit) matches.resize(limit);
+    return matches;
+}
+
+// ---------------------------------------------------------------------------
+// History archive
+//
+// Entries pushed out of the in-memory history rings are kept in ARCHIVE_FILE.
+// Each compaction appends segments of at most ARCHIVE_SEGMENT_ENTRIES entries:
+// a header with the id range and a checksum, then the entries varint-encoded
+// and LZ-compressed. Segments are never rewritten; a torn segment at the end
+// of the file is cut off before the next append. Reading a page of history
+// decompresses only the segments whose id range it overlaps.
+//
+// ARCHIVE_INDEX_FILE lists every segment's header and offset, grouped by kind
+// and in id order, so those segments are found by binary search instead of
+// by walking the archive. It is rewritten after each append and records the
+// archive size it describes; when that does not match, readers fall back to
+// walking the segment headers.
+// ---------------------------------------------------------------------------
+
+const char ARCHIVE_MAGIC[4] = {'M', 'H', 'S', 'A'};
+const char ARCHIVE_INDEX_MAGIC[4] = {'M', 'H', 'S', 'I'};
+const uint32_t ARCHIVE_SEGMENT_ENTRIES = 512;
+
+enum ArchiveKind : uint32_t {
+    ARCHIVE_MOODS = 1,
+    ARCHIVE_THOUGHTS = 2,
+    ARCHIVE_KIND_LIMIT
+};
+
+struct ArchiveSegmentHeader {
+    char magic[4];
+    uint32_t kind;
+    uint64_t firstId;
+    uint64_t lastId;
+    uint32_t count;
+    uint32_t rawSize;
+    uint32_t packedSize;
+    uint32_t checksum; // FNV-1a of the packed bytes
+};
+
+static_assert(sizeof(ArchiveSegmentHeader) == 40, "archive segment layout changed");
+
+struct ArchiveIndexHeader {
+    char magic[4];
+    uint32_t reserved;
+    uint64_t archiveBytes;                 // size of the archive this index describes
+    uint64_t segmentCount[ARCHIVE_KIND_LIMIT]; // records per kind, stored in kind order
+};
+
+struct ArchiveIndexRecord {
+    ArchiveSegmentHeader header;
+    uint64_t payload; // offset of the packed entries in the archive
+};
+
+void putVarint(string& out, uint64_t value) {
+    while (value >= 0x80) {
+        out += (char)(value | 0x80);
+        value >>= 7;
+    }
+    out += (char)value;
+}
+
+bool getVarint(string_view in, size_t& pos, uint64_t& value) {
+    value = 0;
+    for (int shift = 0; shift < 64 && pos < in.size(); shift += 7) {
+        unsigned char byte = in[pos++];
+        value |= (uint64_t)(byte & 0x7f) << shift;
+        if (byte < 0x80) return true;
+    }
+    return false;
+}
+
+bool getString(string_view in, size_t& pos, string& value) {
+    uint64_t length;
+    if (!getVarint(in, pos, length) || length > in.size() - pos) return false;
+    value.assign(in.data() + pos, length);
+    pos += length;
+    return true;
+}
+
+uint32_t checksumBytes(string_view bytes) {
+    uint32_t hash = 2166136261u; // FNV-1a
+    for (unsigned char c : bytes) {
+        hash = (hash ^ c) * 16777619u;
+    }
+    return hash;
+}
+
+// Byte-oriented LZ77. The stream is a list of (literal count, literals,
+// match length, match distance) with a match length of 0 ending it. Matches
+// are found through a single hash of the next four bytes, which is plenty for
+// repeated words and timestamps in journal text.
+string lzCompress(string_view raw) {
+    const size_t minMatch = 4;
+    const int hashBits = 12;
+    vector<uint32_t> recent(size_t(1) << hashBits, UINT32_MAX);
+    string packed;
+    size_t literalStart = 0;
+    size_t pos = 0;
+    while (pos + minMatch <= raw.size()) {
+        uint32_t word;
+        memcpy(&word, raw.data() + pos, sizeof(word));
+        uint32_t slot = (word * 2654435761u) >> (32 - hashBits);
+        size_t candidate = recent[slot];
+        recent[slot] = (uint32_t)pos;
+        if (candidate == UINT32_MAX || memcmp(raw.data() + candidate, raw.data() + pos, minMatch) != 0) {
+            pos++;
+            continue;
+        }
+        size_t length = minMatch;
+        while (pos + length < raw.size() && raw[candidate + length] == raw[pos + length]) length++;
+        putVarint(packed, pos - literalStart);
+        packed.append(raw.data() + literalStart, pos - literalStart);
+        putVarint(packed, length);
+        putVarint(packed, pos - candidate);
+        pos += length;
+        literalStart = pos;
+    }
+    putVarint(packed, raw.size() - literalStart);
+    packed.append(raw.data() + literalStart, raw.size() - literalStart);
+    putVarint(packed, 0);
+    return packed;
+}
+
+bool lzDecompress(string_view packed, size_t rawSize, string& raw) {
+    raw.clear();
+    raw.reserve(rawSize);
+    size_t pos = 0;
+    while (true) {
+        uint64_t literals, length, distance;
+        if (!getVarint(packed, pos, literals) || literals > packed.size() - pos || literals > rawSize - raw.size()) {
+            return false;
+        }
+        raw.append(packed.data() + pos, literals);
+        pos += literals;
+        if (!getVarint(packed, pos, length)) return false;
+        if (length == 0) return raw.size() == rawSize;
+        if (!getVarint(packed, pos, distance) || distance == 0 || distance > raw.size() ||
+            length > rawSize - raw.size()) {
+            return false;
+        }
+        // Byte by byte: a match may overlap the bytes it produces
+        size_t from = raw.size() - distance;
+        for (size_t i = 0; i < length; i++) raw += raw[from + i];
+    }
+}
+
+// Headers of the segments that are complete on disk, with their payload offsets
+vector<pair<ArchiveSegmentHeader, off_t>> archiveSegments(int fd) {
+    vector<pair<ArchiveSegmentHeader, off_t>> segments;
+    struct stat st;
+    if (fstat(fd, &st) != 0) return segments;
+    off_t offset = 0;
+    ArchiveSegmentHeader header;
+    while (st.st_size - offset >= (off_t)sizeof(header)) {
+        if (pread(fd, &header, sizeof(header), offset) != (ssize_t)sizeof(header) ||
+            memcmp(header.magic, ARCHIVE_MAGIC, sizeof(ARCHIVE_MAGIC)) != 0 ||
+            header.packedSize > st.st_size - offset - sizeof(header)) {
+            break;
+        }
+        segments.push_back({header, offset + (off_t)sizeof(header)});
+        offset += sizeof(header) + header.packedSize;
+    }
+    return segments;
+}
+
+bool readArchiveSegment(int fd, const ArchiveSegmentHeader& header, off_t payload, string& raw) {
+    string packed(header.packedSize, '\0');
+    if (pread(fd, &packed[0], packed.size(), payload) != (ssize_t)packed.size()) return false;
+    return checksumBytes(packed) == header.checksum && lzDecompress(packed, header.rawSize, raw);
+}
+
+// Calls visit(id, time, mood) for every event in a decoded mood segment
+template <typename Visitor>
+void forEachArchivedMood(const ArchiveSegmentHeader& header, string_view raw, Visitor visit) {
+    size_t pos = 0;
+    uint64_t id = header.firstId;
+    int64_t time = 0;
+    for (uint32_t i = 0; i < header.count; i++) {
+        uint64_t idDelta, timeDelta;
+        if (!getVarint(raw, pos, idDelta) || !getVarint(raw, pos, timeDelta) || pos >= raw.size()) return;
+        id += idDelta;
+        time += (int64_t)(timeDelta >> 1) ^ -(int64_t)(timeDelta & 1);
+        visit(id, time, (MoodId)raw[pos++]);
+    }
+}
+
+// Calls visit(id, thought, timestamp) for every entry in a decoded thought segment
+template <typename Visitor>
+void forEachArchivedThought(const ArchiveSegmentHeader& header, string_view raw, Visitor visit) {
+    size_t pos = 0;
+    uint64_t id = header.firstId;
+    string thought, timestamp;
+    for (uint32_t i = 0; i < header.count; i++) {
+        uint64_t idDelta;
+        if (!getVarint(raw, pos, idDelta) || !getString(raw, pos, thought) || !getString(raw, pos, timestamp)) return;
+        id += idDelta;
+        visit(id, thought, timestamp);
+    }
+}
+
+// Encodes one segment onto 'out', which will be written at archive offset 'base',
+// and adds it to 'segments'
+void appendArchiveSegment(string& out, off_t base, vector<pair<ArchiveSegmentHeader, off_t>>& segments, uint32_t kind,
+                          uint64_t firstId, uint64_t lastId, uint32_t count, const string& raw) {
+    ArchiveSegmentHeader header = {};
+    string packed = lzCompress(raw);
+    memcpy(header.magic, ARCHIVE_MAGIC, sizeof(ARCHIVE_MAGIC));
+    header.kind = kind;
+    header.firstId = firstId;
+    header.lastId = lastId;
+    header.count = count;
+    header.rawSize = raw.size();
+    header.packedSize = packed.size();
+    header.checksum = checksumBytes(packed);
+    out.append(reinterpret_cast<const char*>(&header), sizeof(header));
+    segments.push_back({header, base + (off_t)out.size()});
+    out += packed;
+}
+
+bool writeArchiveIndex(const StatePaths& paths, const vector<pair<ArchiveSegmentHeader, off_t>>& segments,
+                       uint64_t archiveBytes) {
+    ArchiveIndexHeader header = {};
+    memcpy(header.magic, ARCHIVE_INDEX_MAGIC, sizeof(ARCHIVE_INDEX_MAGIC));
+    header.archiveBytes = archiveBytes;
+    string records;
+    for (uint32_t kind = 0; kind < ARCHIVE_KIND_LIMIT; kind++) {
+        for (const auto& segment : segments) {
+            if (segment.first.kind != kind) continue;
+            ArchiveIndexRecord record = {segment.first, (uint64_t)segment.second};
+            records.append(reinterpret_cast<const char*>(&record), sizeof(record));
+            header.segmentCount[kind]++;
+        }
+    }
+    return replaceFile(paths.archiveIndex, string(reinterpret_cast<const char*>(&header), sizeof(header)) + records);
+}
+
+// Segments of one kind that overlap [lo, hi], in id order
+vector<pair<ArchiveSegmentHeader, off_t>> findArchiveSegments(const StatePaths& paths, int fd, uint32_t kind,
+                                                              uint64_t lo, uint64_t hi) {
+    vector<pair<ArchiveSegmentHeader, off_t>> found;
+    struct stat archive, index;
+    int indexFd = open(paths.archiveIndex.c_str(), O_RDONLY);
+    void* map = MAP_FAILED;
+    if (indexFd >= 0 && fstat(fd, &archive) == 0 && fstat(indexFd, &index) == 0 &&
+        (size_t)index.st_size >= sizeof(ArchiveIndexHeader)) {
+        map = mmap(NULL, index.st_size, PROT_READ, MAP_PRIVATE, indexFd, 0);
+    }
+    if (indexFd >= 0) close(indexFd);
+    
+    if (map != MAP_FAILED) {
+        const ArchiveIndexHeader* header = static_cast<const ArchiveIndexHeader*>(map);
+        const ArchiveIndexRecord* records = reinterpret_cast<const ArchiveIndexRecord*>(header + 1);
+        uint64_t total = 0, first = 0;
+        for (uint32_t k = 0; k < ARCHIVE_KIND_LIMIT; k++) {
+            if (k == kind) first = total;
+            total += header->segmentCount[k];
+        }
+        bool current = memcmp(header->magic, ARCHIVE_INDEX_MAGIC, sizeof(ARCHIVE_INDEX_MAGIC)) == 0 &&
+                       header->archiveBytes == (uint64_t)archive.st_size && kind < ARCHIVE_KIND_LIMIT &&
+                       total == (index.st_size - sizeof(ArchiveIndexHeader)) / sizeof(ArchiveIndexRecord);
+        if (current) {
+            const ArchiveIndexRecord* begin = records + first;
+            const ArchiveIndexRecord* end = begin + header->segmentCount[kind];
+            const ArchiveIndexRecord* it = lower_bound(begin, end, lo, [](const ArchiveIndexRecord& record, uint64_t id) {
+                return record.header.lastId < id;
+            });
+            for (; it != end && it->header.firstId <= hi; ++it) {
+                found.push_back({it->header, (off_t)it->payload});
+            }
+        }
+        munmap(map, index.st_size);
+        if (current) return found;
+    }
+    
+    for (const auto& segment : archiveSegments(fd)) {
+        const ArchiveSegmentHeader& header = segment.first;
+        if (header.kind == kind && header.lastId >= lo && header.firstId <= hi) found.push_back(segment);
+    }
+    return found;
+}
+
+// Appends the state's evicted entries to the archive, skipping any a
+// compaction that died before its snapshot landed already wrote.
+bool archiveEvicted(const StatePaths& paths, const MentalHealthState& state) {
+    if (state.unarchivedMoods.empty() && state.unarchivedThoughts.empty()) return true;
+    int fd = open(paths.archive.c_str(), O_RDWR | O_CREAT, 0644);
+    if (fd < 0) return false;
+    
+    // A crash can leave a final segment of the right size but wrong contents
+    vector<pair<ArchiveSegmentHeader, off_t>> segments = archiveSegments(fd);
+    string raw;
+    if (!segments.empty() && !readArchiveSegment(fd, segments.back().first, segments.back().second, raw)) {
+        segments.pop_back();
+    }
+    off_t end = segments.empty() ? 0 : segments.back().second + segments.back().first.packedSize;
+    uint64_t archivedThrough[ARCHIVE_KIND_LIMIT] = {};
+    for (const auto& segment : segments) {
+        if (segment.first.kind < ARCHIVE_KIND_LIMIT) {
+            archivedThrough[segment.first.kind] = max(archivedThrough[segment.first.kind], segment.first.lastId);
+        }
+    }
+    
+    string out;
+    raw.clear();
+    uint64_t firstId = 0, previousId = 0;
+    int64_t previousTime = 0;
+    uint32_t count = 0;
+    auto endSegment = [&](uint32_t kind) {
+        if (count > 0) appendArchiveSegment(out, end, segments, kind, firstId, previousId, count, raw);
+        raw.clear();
+        count = 0;
+    };
+    for (const MoodEvent& event : state.unarchivedMoods) {
+        if (event.id <= archivedThrough[ARCHIVE_MOODS]) continue;
+        if (count == ARCHIVE_SEGMENT_ENTRIES) endSegment(ARCHIVE_MOODS);
+        if (count++ == 0) {
+            firstId = previousId = event.id;
+            previousTime = 0;
+        }
+        int64_t timeDelta = event.time - previousTime;
+        putVarint(raw, event.id - previousId);
+        putVarint(raw, ((uint64_t)timeDelta << 1) ^ (uint64_t)(timeDelta >> 63));
+        raw += (char)event.mood;
+        previousId = event.id;
+        previousTime = event.time;
+    }
+    endSegment(ARCHIVE_MOODS);
+    
+    for (const JournalEntry& entry : state.unarchivedThoughts) {
+        if (entry.id <= archivedThrough[ARCHIVE_THOUGHTS]) continue;
+        if (count == ARCHIVE_SEGMENT_ENTRIES) endSegment(ARCHIVE_THOUGHTS);
+        if (count++ == 0) firstId = previousId = entry.id;
+        putVarint(raw, entry.id - previousId);
+        putVarint(raw, entry.thought.size());
+        raw += entry.thought;
+        putVarint(raw, entry.timestamp.size());
+        raw += entry.timestamp;
+        previousId = entry.id;
+    }
+    endSegment(ARCHIVE_THOUGHTS);
+    
+    // Synced before the snapshot that drops these entries replaces the old one
+    bool ok = ftruncate(fd, end) == 0 && lseek(fd, end, SEEK_SET) == end && writeAll(fd, out.data(), out.size()) &&
+              fdatasync(fd) == 0;
+    ok = (close(fd) == 0) && ok;
+    return ok && writeArchiveIndex(paths, segments, end + out.size());
+}
+
+// Decodes the archived segments of one kind that overlap [lo, hi]
+template <typename Visitor>
+void readArchive(const StatePaths& paths, uint32_t kind, uint64_t lo, uint64_t hi, Visitor visit) {
+    int fd = open(paths.archive.c_str(), O_RDONLY);
+    if (fd < 0) return;
+    string raw;
+    for (const auto& segment : findArchiveSegments(paths, fd, kind, lo, hi)) {
+        if (readArchiveSegment(fd, segment.first, segment.second, raw)) visit(segment.first, raw);
+    }
+    close(fd);
+}
+
+// Mood events by id (sorted ids in, found events out), looked up in the
+// ring, then among the events waiting for the archive, then in the archive.
+map<unsigned long long, MoodEvent> collectMoods(const StatePaths& paths, const MentalHealthState& state,
+                                                 const vector<unsigned long long>& ids) {
+    map<unsigned long long, MoodEvent> found;
+    const MoodSeries& series = state.moodHistory;
+    unsigned long long firstKept = series.eventsRecorded - series.size() + 1;
+    vector<unsigned long long> older;
+    for (unsigned long long id : ids) {
+        if (id >= firstKept && id <= series.eventsRecorded) {
+            found[id] = {id, series.times[id - firstKept], series.moods[id - firstKept]};
+        } else {
+            older.push_back(id);
+        }
+    }
+    for (const MoodEvent& event : state.unarchivedMoods) {
+        if (binary_search(older.begin(), older.end(), event.id)) found.emplace(event.id, event);
+    }
+    if (found.size() < ids.size() && !older.empty()) {
+        readArchive(paths, ARCHIVE_MOODS, older.front(), older.back(),
+                    [&](const ArchiveSegmentHeader& header, string_view raw) {
+            forEachArchivedMood(header, raw, [&](uint64_t id, int64_t time, MoodId mood) {
+                if (binary_search(older.begin(), older.end(), id)) found.emplace(id, MoodEvent{id, time, mood});
+            });
+        });
+    }
+    return found;
+}
+
+// Journal entries by id, searched the same way as collectMoods()
+map<unsigned long long, JournalEntry> collectThoughts(const StatePaths& paths, const MentalHealthState& state,
+                                                       const vector<unsigned long long>& ids) {
+    map<unsigned long long, JournalEntry> found;
+    unsigned long long firstKept = state.thoughtsRecorded - state.thoughtJournal.size() + 1;
+    vector<unsigned long long> older;
+    for (unsigned long long id : ids) {
+        if (id >= firstKept && id <= state.thoughtsRecorded) {
+            const pair<string, string>& entry = state.thoughtJournal[id - firstKept];
+            found[id] = {id, entry.first, entry.second};
+        } else {
+            older.push_back(id);
+        }
+    }
+    for (const JournalEntry& entry : state.unarchivedThoughts) {
+        if (binary_search(older.begin(), older.end(), entry.id)) found.emplace(entry.id, entry);
+    }
+    if (found.size() < ids.size() && !older.empty()) {
+        readArchive(paths, ARCHIVE_THOUGHTS, older.front(), older.back(),
+                    [&](const ArchiveSegmentHeader& header, string_view raw) {
+            forEachArchivedThought(header, raw, [&](uint64_t id, const string& thought, const string& timestamp) {
+                if (binary_search(older.begin(), older.end(), id)) found.emplace(id, JournalEntry{id, thought, timestamp});
+            });
+        });
+    }
+    return found;
+}
+
+// Writes a full snapshot. It goes to a temporary file first so a reader never
+// sees a half-written snapshot.
+bool saveState(const StatePaths& paths, const MentalHealthState& state) {
+    SnapshotWriter writer;
+    SnapshotHeader header = {};
+    header.version = state.version;
+    header.lastStrategyTime = state.lastStrategyTime;
+    header.currentMood = writer.addString(moodName(state.currentMood));
+    header.lastStrategyUsed = writer.addString(state.lastStrategyUsed);
+    
+    // Save mood statistics
+    vector<MoodStatRecord> stats;
+    for (size_t id = 0; id < MOOD_COUNT; id++) {
+        if (state.moodStatistics[id] > 0) stats.push_back({writer.addString(MOODS[id].name), state.moodStatistics[id]});
+    }
+    writer.addTable(SECTION_MOOD_STATS, stats);
+    
+    // Mood events, column by column, and the per-day buckets. The name table
+    // keeps the codes meaningful if MOODS is ever reordered.
+    const MoodSeries& series = state.moodHistory;
+    vector<StringRef> moodNames;
+    for (const auto& mood : MOODS) {
+        moodNames.push_back(writer.addString(mood.name));
+    }
+    writer.addTable(SECTION_MOOD_NAMES, moodNames);
+    vector<int64_t> times;
+    vector<uint16_t> codes;
+    vector<uint64_t> moodVersions;
+    for (size_t i = 0; i < series.size(); i++) {
+        times.push_back(series.times[i]);
+        codes.push_back(series.moods[i]);
+        moodVersions.push_back(series.versions[i]);
+    }
+    writer.addTable(SECTION_MOOD_EVENT_TIMES, times);
+    writer.addTable(SECTION_MOOD_EVENT_CODES, codes);
+    writer.addTable(SECTION_MOOD_EVENT_VERSIONS, moodVersions);
+    vector<DayCountRecord> days;
+    for (const auto& day : series.dayCounts) {
+        for (size_t id = 0; id < MOOD_COUNT; id++) {
+            if (day.second[id] > 0) days.push_back({day.first, (uint16_t)id, 0, day.second[id]});
+        }
+    }
+    writer.addTable(SECTION_MOOD_DAY_COUNTS, days);
+    
+    vector<ThoughtRecord> journal;
+    for (size_t i = 0; i < state.thoughtJournal.size(); i++) {
+        journal.push_back({writer.addString(state.thoughtJournal[i].first), writer.addString(state.thoughtJournal[i].second)});
+    }
+    writer.addTable(SECTION_THOUGHT_JOURNAL, journal);
+    vector<uint64_t> thoughtVersions;
+    for (size_t i = 0; i < state.thoughtVersions.size(); i++) {
+        thoughtVersions.push_back(state.thoughtVersions[i]);
+    }
+    writer.addTable(SECTION_THOUGHT_VERSIONS, thoughtVersions);
+    
+    vector<StringRef> strategies;
+    vector<StrategyUsageRecord> strategyUsage;
+    for (const auto& strategy : state.copingStrategies) {
+        strategies.push_back(writer.addString(strategy.text));
+        strategyUsage.push_back({strategy.uses, 0, strategy.lastUsed});
+    }
+    writer.addTable(SECTION_STRATEGIES, strategies);
+    writer.addTable(SECTION_STRATEGY_USAGE, strategyUsage);
+    
+    SnapshotTotals totals = {};
+    totals.thoughtsRecorded = state.thoughtsRecorded;
+    totals.lastLogDay = series.lastLogDay;
+    totals.currentStreak = series.currentStreak;
+    totals.longestStreak = series.longestStreak;
+    totals.moodsRecorded = series.eventsRecorded;
+    totals.strategiesVersion = state.strategiesVersion;
+    totals.strategyCursor = state.strategyCursor;
+    totals.currentMoodTime = state.currentMoodTime;
+    writer.addRecord(SECTION_TOTALS, totals);
+    
+    // The snapshot no longer carries evicted or unindexed entries, so those
+    // are archived and indexed first
+    if (!archiveEvicted(paths, state)) return false;
+    if (!updateThoughtIndex(paths, state.unindexedThoughts)) return false;
+    return replaceFile(paths.snapshot, writer.finish(header));
+}
+
+string formatTimestamp(time_t when) {
+    tm local;
+    localtime_r(&when, &local);
+    char buffer[20];
+    strftime(buffer, sizeof(buffer), "%Y-%m-%d %H:%M", &local);
+    return string(buffer);
+}
+
+string getTimestamp() {
+    return formatTimestamp(time(0));
+}
+
+string formatTimeAgo(time_t pastTime) {
+    time_t now = time(0);
+    double seconds = difftime(now, pastTime);
+    
+    if (seconds < 60) return "just now";
+    if (seconds < 3600) return to_string(static_cast<int>(seconds/60)) + " minutes ago";
+    if (seconds < 86400) return to_string(static_cast<int>(seconds/3600)) + " hours ago";
+    return to_string(static_cast<int>(seconds/86400)) + " days ago";
+}
+
+// Everything up to the current mood: document head, CSS, chat widget
+// (internet चाहिए) and page header. Built once at compile time.
+const string_view PAGE_HEAD = R"HTML(<!DOCTYPE html>
+<html lang='en'>
+<head>
+<meta charset='UTF-8'>
+<meta name='viewport' content='width=device-width, initial-scale=1.0'>
+<title>Enhanced Mental Health Tracker</title>
+<script src='https://cdn.jotfor.ms/agent/embedjs/0198cbf6508f730a8d1f0df6d65ae0f3d772/embed.js'></script>
+<style>
+        * { box-sizing: border-box; margin: 0; padding: 0; font-family: 'Segoe UI', Tahoma, Geneva, Verdana, sans-serif; }
+        body { background: linear-gradient(135deg, #1a2a6c, #b21f1f, #fdbb2d); padding: 20px; color: #333; min-height: 100vh; }
+        .header { text-align: center; margin-bottom: 30px; color: white; text-shadow: 0 2px 4px rgba(0,0,0,0.3); }
+        .header h1 { margin-bottom: 10px; font-size: 2.5em; }
+        .header p { font-size: 1.2em; opacity: 0.9; }
+        .container { display: grid; grid-template-columns: repeat(auto-fit, minmax(350px, 1fr)); gap: 25px; max-width: 1400px; margin: 0 auto; }
+        .panel { background: rgba(255, 255, 255, 0.95); border-radius: 15px; box-shadow: 0 8px 30px rgba(0,0,0,0.15); overflow: hidden; transition: transform 0.3s ease, box-shadow 0.3s ease; }
+        .panel:hover { transform: translateY(-5px); box-shadow: 0 12px 40px rgba(0,0,0,0.2); }
+        .panel-header { padding: 20px; color: white; font-weight: bold; font-size: 1.3em; display: flex; align-items: center; gap: 12px; }
+        .panel-header.mood { background: linear-gradient(to right, #ff7e5f, #feb47b); }
+        .panel-header.thoughts { background: linear-gradient(to right, #00cdac, #02aab0); }
+        .panel-header.strategies { background: linear-gradient(to right, #7474bf, #348ac7); }
+        .panel-header.stats { background: linear-gradient(to right, #8e2de2, #4a00e0); }
+        .panel-content { padding: 25px; }
+        .current-value { margin: 15px 0; padding: 18px; background: #f8f9fa; border-radius: 10px; border-left: 5px solid #3498db; font-size: 1.1em; }
+        .visualization { border: 1px solid #e0e0e0; border-radius: 10px; padding: 15px; margin: 15px 0; min-height: 200px; max-height: 300px; overflow-y: auto; background: #fafafa; }
+        .mood-item, .thought-item, .strategy-item { padding: 12px; border-radius: 8px; margin-bottom: 10px; display: flex; justify-content: space-between; align-items: center; }
+        .mood-item { background: linear-gradient(to right, #fff5f5, #ffecec); border-left: 4px solid #ff7e5f; }
+        .thought-item { background: linear-gradient(to right, #f0fdfa, #e6fcf7); border-left: 4px solid #00cdac; }
+        .strategy-item { background: linear-gradient(to right, #f0f4ff, #e6edff); border-left: 4px solid #7474bf; }
+        .empty-message { color: #7f8c8d; text-align: center; padding: 30px; font-style: italic; }
+        form { margin-top: 20px; }
+        select, input[type='text'], textarea { width: 100%; padding: 14px; margin-bottom: 15px; border: 1px solid #ddd; border-radius: 8px; font-size: 1em; }
+        textarea { min-height: 100px; resize: vertical; }
+        button { padding: 14px 20px; border: none; border-radius: 8px; color: white; cursor: pointer; font-weight: bold; margin-right: 10px; margin-bottom: 10px; transition: all 0.2s ease; }
+        .btn-primary { background: #3498db; }
+        .btn-primary:hover { background: #2980b9; transform: scale(1.05); }
+        .btn-warning { background: #e67e22; }
+        .btn-warning:hover { background: #d35400; transform: scale(1.05); }
+        .btn-success { background: #2ecc71; }
+        .btn-success:hover { background: #27ae60; transform: scale(1.05); }
+        .btn-info { background: #9b59b6; }
+        .btn-info:hover { background: #8e44ad; transform: scale(1.05); }
+        .mood-emoji { font-size: 1.8em; }
+        .timestamp { font-size: 0.85em; color: #7f8c8d; }
+        .stats-grid { display: grid; grid-template-columns: repeat(auto-fit, minmax(120px, 1fr)); gap: 15px; margin: 15px 0; }
+        .stat-item { background: #f8f9fa; padding: 15px; border-radius: 8px; text-align: center; border: 1px solid #e0e0e0; }
+        .stat-value { font-size: 1.8em; font-weight: bold; color: #2c3e50; }
+        .stat-label { font-size: 0.9em; color: #7f8c8d; }
+        .progress-bar { height: 10px; background: #ecf0f1; border-radius: 5px; overflow: hidden; margin-top: 5px; }
+        .progress-fill { height: 100%; background: linear-gradient(to right, #3498db, #2ecc71); }
+        .chat-widget-container { position: fixed; top: 20px; right: 20px; z-index: 1000; }
+        .chat-toggle-btn { padding: 12px 20px; background: linear-gradient(to right, #3498db, #2ecc71); color: white; border: none; border-radius: 8px; font-weight: bold; cursor: pointer; box-shadow: 0 4px 8px rgba(0,0,0,0.2); transition: all 0.3s ease; }
+        .chat-toggle-btn:hover { transform: scale(1.05); box-shadow: 0 6px 12px rgba(0,0,0,0.3); }
+        @media (max-width: 768px) { .container { grid-template-columns: 1fr; } .chat-widget-container { top: 10px; right: 10px; } .chat-toggle-btn { padding: 10px 15px; font-size: 0.9em; } }
+</style>
+</head>
+<body>
+<div class='chat-widget-container'>
+<button class='chat-toggle-btn' onclick="window.JFAgent && window.JFAgent.open(); return false;">💬 Chat with AI Counselor</button>
+</div>
+<div class='header'>
+<h1>🌱 Enhanced Mental Health Tracker</h1>
+<p>Comprehensive mood tracking, thought journaling, and coping strategies</p>
+</div>
+<div class='container'>
+<div class='panel'>
+<div class='panel-header mood'><span>📊</span> Mood Tracker</div>
+<div class='panel-content'>
+<div class='current-value'>
+<strong>Current mood:</strong> )HTML";
+
+// Fixed markup between the dynamic parts of the dashboard, in page order.
+// They are emitted as-is, so a page view is one pass of appends into a
+// reusable buffer instead of a few hundred formatted stream writes.
+const string_view MOOD_VISUALIZATION_OPEN = "\n</div>\n<div class='visualization'>\n";
+
+const string_view MOOD_FORM_OPEN =
+    "</div>\n"
+    "<form method='GET'>\n"
+    "<select name='moodInput'>\n"
+    "<option value=''>Select a mood</option>\n";
+
+const string_view THOUGHTS_PANEL_OPEN =
+    "</select>\n"
+    "<button type='submit' name='action' value='logMood' class='btn-primary'>Log Mood</button>\n"
+    "</form>\n"
+    "</div>\n"
+    "</div>\n"
+    "<div class='panel'>\n"
+    "<div class='panel-header thoughts'><span>📝</span> Thought Journal</div>\n"
+    "<div class='panel-content'>\n"
+    "<div class='current-value'>\n"
+    "<strong>Recent thoughts:</strong> ";
+
+const string_view THOUGHT_FORM =
+    "<form method='POST'>\n"
+    "<textarea name='thoughtInput' placeholder='What&apos;s on your mind? Writing can help process emotions...'></textarea>\n"
+    "<button type='submit' name='action' value='addThought' class='btn-success'>Journal Thought</button>\n"
+    "</form>\n"
+    "<form method='GET' style='margin-top: 10px;'>\n"
+    "<input type='text' name='q' placeholder='Search your journal (word* matches prefixes)'>\n"
+    "<button type='submit' name='action' value='searchThoughts' class='btn-info'>Search Journal</button>\n"
+    "</form>\n"
+    "</div>\n"
+    "</div>\n"
+    "<div class='panel'>\n"
+    "<div class='panel-header strategies'><span>🛠️</span> Coping Strategies</div>\n"
+    "<div class='panel-content'>\n"
+    "<div class='current-value'>\n"
+    "<strong>Last strategy used:</strong> ";
+
+const string_view STRATEGY_FORMS_AND_STATS_OPEN =
+    "</div>\n"
+    "<form method='GET'>\n"
+    "<button type='submit' name='action' value='suggestStrategy' class='btn-warning'>Suggest a Strategy</button>\n"
+    "<button type='submit' name='action' value='useStrategy' class='btn-success'>Use This Strategy</button>\n"
+    "<button type='submit' name='action' value='addStrategy' class='btn-info'>Add New Strategy</button>\n"
+    "</form>\n"
+    "<form method='POST' style='margin-top: 10px;'>\n"
+    "<input type='text' name='newStrategy' placeholder='Enter a new coping strategy'>\n"
+    "<button type='submit' name='action' value='addCustomStrategy' class='btn-primary'>Add Custom</button>\n"
+    "</form>\n"
+    "</div>\n"
+    "</div>\n"
+    "<div class='panel'>\n"
+    "<div class='panel-header stats'><span>📈</span> Mood Statistics</div>\n"
+    "<div class='panel-content'>\n";
+
+const string_view STATS_FORM =
+    "<form method='GET'>\n"
+    "<button type='submit' name='action' value='moodTrends' class='btn-info'>View Trends</button>\n"
+    "</form>\n"
+    "<form method='GET' style='margin-top: 10px;'>\n"
+    "<input type='hidden' name='action' value='history'>\n"
+    "<button type='submit' name='kind' value='moods' class='btn-primary'>Mood History</button>\n"
+    "<button type='submit' name='kind' value='thoughts' class='btn-primary'>Journal History</button>\n"
+    "<button type='submit' name='kind' value='strategies' class='btn-primary'>All Strategies</button>\n"
+    "</form>\n";
+
+const string_view PAGE_TAIL =
+    "</div>\n"
+    "</div>\n"
+    "</div>\n"
+    "</body>\n"
+    "</html>\n";
+
+// Request-specific content shown on top of the state, e.g. search results.
+struct PageExtras {
+    bool showTrends = false;
+    bool searched = false;
+    string searchQuery;
+    vector<pair<string, string>> searchResults; // thought + timestamp, newest first
+    size_t searchResultsDropped = 0;           // matches no longer stored anywhere
+    
+    // One page of a collection: moods and thoughts newest first, strategies by id
+    string historyKind;
+    size_t historyPageSize = 0;          // as requested with size=, 0 = default
+    unsigned long long historyFirst = 0; // lowest and highest id on the page
+    unsigned long long historyLast = 0;
+    unsigned long long historyPrevCursor = 0; // cursors of the neighbouring pages, 0 = none
+    unsigned long long historyNextCursor = 0;
+    vector<MoodEvent> historyMoods;
+    vector<JournalEntry> historyThoughts;
+    vector<pair<unsigned long long, StrategyStore::Entry>> historyStrategies; // by id
+};
+
+void appendEscaped(string& out, string_view text) {
+    for (char c : text) {
+        switch (c) {
+            case '&': out += "&amp;"; break;
+            case '<': out += "&lt;"; break;
+            case '>': out += "&gt;"; break;
+            case '\'': out += "&#39;"; break;
+            case '"': out += "&quot;"; break;
+            default: out += c;
+        }
+    }
+}
+
+void appendNumber(string& out, long long value) {
+    char digits[24];
+    int len = snprintf(digits, sizeof(digits), "%lld", value);
+    out.append(digits, len);
+}
+
+void appendMood(string& out, MoodId id, const AppConfig& config) {
+    string_view name = moodName(id);
+    string_view emoji = id < MOOD_COUNT ? string_view(config.moodEmojis[id]) : moodEmoji(id);
+    out.append(name.data(), name.size());
+    out += ' ';
+    out.append(emoji.data(), emoji.size());
+}
+
+// One windowed distribution: total plus a bar per mood that occurred
+void appendMoodWindow(string& out, const char* label, const MoodCounts& counts, const AppConfig& config) {
+    long long total = 0;
+    for (uint32_t count : counts) total += count;
+    out += "<div class='current-value'>\n<strong>";
+    out += label;
+    out += ":</strong> ";
+    appendNumber(out, total);
+    out += " moods logged\n";
+    for (size_t id = 0; id < MOOD_COUNT; id++) {
+        if (counts[id] == 0) continue;
+        out += "<div class='stat-label'>";
+        appendMood(out, (MoodId)id, config);
+        out += " &middot; ";
+        appendNumber(out, counts[id]);
+        out += "</div>\n<div class='progress-bar'><div class='progress-fill' style='width: ";
+        appendNumber(out, (uint64_t)counts[id] * 100 / total);
+        out += "%'></div></div>\n";
+    }
+    out += "</div>\n";
+}
+
+void appendHistoryLink(string& out, const PageExtras& extras, unsigned long long cursor, const char* label) {
+    out += "<a href='?action=history&amp;kind=";
+    out += extras.historyKind;
+    out += "&amp;cursor=";
+    appendNumber(out, cursor);
+    if (extras.historyPageSize > 0) {
+        out += "&amp;size=";
+        appendNumber(out, extras.historyPageSize);
+    }
+    out += "'>";
+    out += label;
+    out += "</a> ";
+}
+
+// A page of the full mood, journal or strategy list, including archived entries
+void appendHistoryPage(string& out, const PageExtras& extras, const AppConfig& config) {
+    bool strategies = extras.historyKind == "strategies";
+    out += "<div class='visualization'>\n<div class='current-value'><strong>";
+    out += strategies ? "Strategies" : extras.historyKind == "moods" ? "Mood history" : "Journal history";
+    out += "</strong>";
+    if (extras.historyFirst > 0) {
+        out += " &middot; entries ";
+        appendNumber(out, extras.historyFirst);
+        out += "&ndash;";
+        appendNumber(out, extras.historyLast);
+    }
+    out += "</div>\n";
+    if (extras.historyMoods.empty() && extras.historyThoughts.empty() && extras.historyStrategies.empty()) {
+        out += "<div class='empty-message'>Nothing recorded on this page.</div>\n";
+    }
+    for (const MoodEvent& event : extras.historyMoods) {
+        out += "<div class='mood-item'><span>";
+        appendMood(out, event.mood, config);
+        out += "</span><span class='timestamp'>";
+        out += event.time > 0 ? formatTimeAgo(event.time) : "Recorded";
+        out += "</span></div>\n";
+    }
+    for (const JournalEntry& entry : extras.historyThoughts) {
+        out += "<div class='thought-item'><div>";
+        appendEscaped(out, entry.thought);
+        out += "</div><div class='timestamp'>";
+        appendEscaped(out, entry.timestamp);
+        out += "</div></div>\n";
+    }
+    for (const auto& strategy : extras.historyStrategies) {
+        out += "<div class='strategy-item'>";
+        appendNumber(out, strategy.first);
+        out += ". ";
+        appendEscaped(out, strategy.second.text);
+        if (strategy.second.uses > 0) {
+            out += "<div class='timestamp'>Used ";
+            appendNumber(out, strategy.second.uses);
+            out += strategy.second.uses == 1 ? " time, last " : " times, last ";
+            out += formatTimeAgo(strategy.second.lastUsed);
+            out += "</div>";
+        }
+        out += "</div>\n";
+    }
+    out += "<div class='timestamp'>";
+    if (extras.historyPrevCursor > 0) {
+        appendHistoryLink(out, extras, extras.historyPrevCursor, strategies ? "&laquo; Previous" : "&laquo; Newer");
+    }
+    if (extras.historyNextCursor > 0) {
+        appendHistoryLink(out, extras, extras.historyNextCursor, strategies ? "Next &raquo;" : "Older &raquo;");
+    }
+    out += "</div>\n</div>\n";
+}
+
+void printPage(string& out, const MentalHealthState& state, const AppConfig& config,
+               const PageExtras& extras = PageExtras()) {
+    out += PAGE_HEAD;
+    
+    // Mood Tracker Panel
+    appendMood(out, state.currentMood, config);
+    out += MOOD_VISUALIZATION_OPEN;
+    
+    // Mood History Visualization
+    const MoodSeries& history = state.moodHistory;
+    if (history.size() == 0) {
+        out += "<div class='empty-message'>No mood history yet. Start tracking your moods!</div>\n";
+    } else {
+        int startIdx = max(0, static_cast<int>(history.size()) - 10);
+        for (int i = (int)history.size() - 1; i >= startIdx; i--) {
+            out += "<div class='mood-item'><span>";
+            appendMood(out, history.moods[i], config);
+            out += "</span><span class='timestamp'>";
+            out += history.times[i] > 0 ? formatTimeAgo(history.times[i]) : "Recorded";
+            out += "</span></div>\n";
+        }
+        if (history.eventsRecorded > 10) {
+            out += "<div class='timestamp'><a href='?action=history&amp;kind=moods'>All moods &raquo;</a></div>\n";
+        }
+    }
+    
+    // Mood Form
+    out += MOOD_FORM_OPEN;
+    for (MoodId id : config.offeredMoods) {
+        out += "<option value='";
+        out.append(MOODS[id].name.data(), MOODS[id].name.size());
+        out += "'>";
+        appendMood(out, id, config);
+        out += "</option>\n";
+    }
+    
+    // Thought Journal Panel
+    out += THOUGHTS_PANEL_OPEN;
+    out += state.thoughtJournal.empty() ? "No thoughts recorded yet" : "";
+    out += "\n</div>\n<div class='visualization'>\n";
+    
+    // Thought Journal Visualization
+    if (state.thoughtJournal.empty()) {
+        out += "<div class='empty-message'>Your thoughts will appear here. Journaling helps process emotions.</div>\n";
+    } else {
+        int startIdx = max(0, static_cast<int>(state.thoughtJournal.size()) - 5);
+        for (int i = (int)state.thoughtJournal.size() - 1; i >= startIdx; i--) {
+            out += "<div class='thought-item'><div>";
+            appendEscaped(out, state.thoughtJournal[i].first);
+            out += "</div><div class='timestamp'>";
+            appendEscaped(out, state.thoughtJournal[i].second);
+            out += "</div></div>\n";
+        }
+        if (state.thoughtsRecorded > 5) {
+            out += "<div class='timestamp'><a href='?action=history&amp;kind=thoughts'>All entries &raquo;</a></div>\n";
+        }
+    }
+    out += "</div>\n";
+    
+    // Journal search results
+    if (extras.searched) {
+        out += "<div class='visualization'>\n<div class='current-value'><strong>Search results for</strong> &quot;";
+        appendEscaped(out, extras.searchQuery);
+        out += "&quot;: ";
+        appendNumber(out, extras.searchResults.size() + extras.searchResultsDropped);
+        out += "</div>\n";
+        if (extras.searchResults.empty() && extras.searchResultsDropped == 0) {
+            out += "<div class='empty-message'>No journal entries match.</div>\n";
+        }
+        for (const auto& result : extras.searchResults) {
+            out += "<div class='thought-item'><div>";
+            appendEscaped(out, result.first);
+            out += "</div><div class='timestamp'>";
+            appendEscaped(out, result.second);
+            out += "</div></div>\n";
+        }
+        if (extras.searchResultsDropped > 0) {
+            out += "<div class='empty-message'>";
+            appendNumber(out, extras.searchResultsDropped);
+            out += " older matching entries are no longer kept in the journal.</div>\n";
+        }
+        out += "</div>\n";
+    }
+    
+    // Thought Journal Form + Coping Strategies Panel
+    out += THOUGHT_FORM;
+    appendEscaped(out, state.lastStrategyUsed);
+    out += '\n';
+    if (state.lastStrategyTime > 0) {
+        out += "<div class='timestamp'>";
+        out += formatTimeAgo(state.lastStrategyTime);
+        out += "</div>\n";
+    }
+    out += "</div>\n<div class='visualization'>\n";
+    
+    // Strategies Visualization
+    if (state.copingStrategies.empty()) {
+        out += "<div class='empty-message'>No strategies available. Add some below!</div>\n";
+    } else {
+        // Show up to 5 strategies, starting with the current suggestion
+        size_t total = state.copingStrategies.size();
+        for (size_t i = 0; i < min<size_t>(total, 5); i++) {
+            out += "<div class='strategy-item'>";
+            appendEscaped(out, state.copingStrategies[(state.strategyCursor + i) % total].text);
+            out += "</div>\n";
+        }
+        if (total > 5) {
+            out += "<div class='timestamp'><a href='?action=history&amp;kind=strategies'>All strategies &raquo;</a></div>\n";
+        }
+    }
+    
+    // Strategies Forms + Statistics Panel
+    out += STRATEGY_FORMS_AND_STATS_OPEN;
+    
+    // Calculate total mood entries
+    long long total = 0;
+    for (uint32_t count : state.moodStatistics) {
+        total += count;
+    }
+    
+    if (total == 0) {
+        out += "<div class='empty-message'>No statistics yet. Start tracking your mood!</div>\n";
+    } else {
+        out += "<div class='stats-grid'>\n";
+        for (size_t id = 0; id < MOOD_COUNT; id++) {
+            uint32_t count = state.moodStatistics[id];
+            if (count == 0) continue;
+            out += "<div class='stat-item'>\n<div class='stat-value'>";
+            appendNumber(out, count);
+            out += "</div>\n<div class='stat-label'>";
+            appendMood(out, (MoodId)id, config);
+            out += "</div>\n<div class='progress-bar'><div class='progress-fill' style='width: ";
+            appendNumber(out, (uint64_t)count * 100 / total);
+            out += "%'></div></div>\n</div>\n";
+        }
+        out += "</div>\n";
+        
+        // Find most common mood
+        MoodId mostCommonMood = 0;
+        uint32_t maxCount = 0;
+        for (size_t id = 0; id < MOOD_COUNT; id++) {
+            if (state.moodStatistics[id] > maxCount) {
+                maxCount = state.moodStatistics[id];
+                mostCommonMood = (MoodId)id;
+            }
+        }
+        
+        out += "<div class='current-value'>\n<strong>Most common mood:</strong> ";
+        appendMood(out, mostCommonMood, config);
+        out += "\n<div class='timestamp'>";
+        appendNumber(out, maxCount);
+        out += " recorded instances</div>\n</div>\n";
+    }
+    
+    // Streaks and windowed distributions, all read from running aggregates
+    int32_t today = localDay(time(0));
+    out += "<div class='current-value'>\n<strong>Logging streak:</strong> ";
+    appendNumber(out, history.streakAsOf(today));
+    out += " days\n<div class='timestamp'>Longest streak: ";
+    appendNumber(out, history.longestStreak);
+    out += " days</div>\n</div>\n";
+    if (extras.showTrends) {
+        appendMoodWindow(out, "Today", history.bucket(history.dayCounts, today), config);
+        appendMoodWindow(out, "This week", history.bucket(history.weekCounts, weekOfDay(today)), config);
+        appendMoodWindow(out, "Last 7 days", history.rolling(7, today), config);
+        appendMoodWindow(out, "Last 30 days", history.rolling(30, today), config);
+    }
+    if (!extras.historyKind.empty()) appendHistoryPage(out, extras, config);
+    out += STATS_FORM;
+    out += PAGE_TAIL;
+}
+
+int hexValue(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+// Decodes application/x-www-form-urlencoded text in place ('+' and %XX) in a
+// single linear pass and returns the decoded length. A '%' that is not
+// followed by two hex digits is kept as-is.
+size_t urlDecodeInPlace(char* data, size_t len) {
+    size_t out = 0;
+    for (size_t in = 0; in < len; in++) {
+        char c = data[in];
+        if (c == '+') {
+            c = ' ';
+        } else if (c == '%' && in + 2 < len) {
+            int hi = hexValue(data[in + 1]);
+            int lo = hexValue(data[in + 2]);
+            if (hi >= 0 && lo >= 0) {
+                c = static_cast<char>(hi * 16 + lo);
+                in += 2;
+            }
+        }
+        data[out++] = c;
+    }
+    return out;
+}
+
+string urlDecode(string_view encoded) {
+    string decoded(encoded);
+    decoded.resize(urlDecodeInPlace(&decoded[0], decoded.size()));
+    return decoded;
+}
+
+// Walks "key=value&key=value" once, decoding every key and value in place
+// inside 'buffer', and calls visit(key, value) with views into it.
+template <typename Visitor>
+void forEachFormField(string& buffer, Visitor visit) {
+    char* data = &buffer[0];
+    size_t len = buffer.size();
+    size_t pos = 0;
+    while (pos < len) {
+        size_t fieldEnd = pos;
+        size_t eq = string::npos;
+        while (fieldEnd < len && data[fieldEnd] != '&') {
+            if (data[fieldEnd] == '=' && eq == string::npos) eq = fieldEnd;
+            fieldEnd++;
+        }
+        if (fieldEnd > pos) {
+            size_t keyEnd = eq == string::npos ? fieldEnd : eq;
+            size_t keyLen = urlDecodeInPlace(data + pos, keyEnd - pos);
+            size_t valueLen = 0;
+            if (eq != string::npos) {
+                valueLen = urlDecodeInPlace(data + eq + 1, fieldEnd - eq - 1);
+            }
+            visit(string_view(data + pos, keyLen),
+                  eq == string::npos ? string_view() : string_view(data + eq + 1, valueLen));
+        }
+        pos = fieldEnd + 1;
+    }
+}
+
+struct RequestParams {
+    string action;
+    string moodInput;
+    string thoughtInput;
+    string newStrategy;
+    string searchQuery;
+    string format;      // "json" for the JSON API; import/export: "csv" or "jsonl"
+    string historyKind; // "moods", "thoughts" or "strategies"
+    string token;       // action=population: the configured ADMIN_TOKEN
+    unsigned long long historyCursor = 0; // id the page starts at; 0 = newest (moods, thoughts) or first
+    size_t pageSize = 0;                  // 0 = the configured page size
+    unsigned long long since = 0; // JSON API: only what changed after this version
+    bool hasSince = false;
+};
+
+// Fills the parameters from one urlencoded source. Keys must match exactly;
+// a later source (the POST body) overrides an earlier one (the query string).
+void parseFormFields(string_view encoded, RequestParams& params) {
+    string buffer(encoded);
+    forEachFormField(buffer, [&params](string_view key, string_view value) {
+        if (key == "action") params.action = value;
+        else if (key == "moodInput") params.moodInput = value;
+        else if (key == "thoughtInput") params.thoughtInput = value;
+        else if (key == "newStrategy") params.newStrategy = value;
+        else if (key == "q") params.searchQuery = value;
+        else if (key == "kind") params.historyKind = value;
+        else if (key == "format") params.format = value;
+        else if (key == "token") params.token = value;
+        else if (key == "cursor") params.historyCursor = strtoull(string(value).c_str(), NULL, 10);
+        else if (key == "size") params.pageSize = strtoul(string(value).c_str(), NULL, 10);
+        else if (key == "since") {
+            params.since = strtoull(string(value).c_str(), NULL, 10);
+            params.hasSince = true;
+        }
+    });
+}
+
+bool isFormBody(const string& contentType) {
+    const string formType = "application/x-www-form-urlencoded";
+    return contentType.compare(0, formType.size(), formType) == 0;
+}
+
+RequestParams parseRequest(string_view query, string_view formBody) {
+    RequestParams params;
+    parseFormFields(query, params);
+    parseFormFields(formBody, params);
+    return params;
+}
+
+void prepareState(MentalHealthState& state, const AppConfig& config) {
+    // Entries migrated from formats without versions count as version 0
+    if (state.thoughtVersions.size() != state.thoughtJournal.size()) {
+        state.thoughtVersions = RingBuffer<uint64_t>();
+        for (size_t i = 0; i < state.thoughtJournal.size(); i++) state.thoughtVersions.push_back(0);
+    }
+    
+    // Size the history rings; whatever no longer fits waits for the archive
+    size_t capacity = max(1, config.maxHistoryItems);
+    state.moodHistory.setCapacity(capacity, state.unarchivedMoods);
+    unsigned long long firstThoughtId = state.thoughtsRecorded - state.thoughtJournal.size() + 1;
+    vector<pair<string, string>> evicted;
+    state.thoughtJournal.setCapacity(capacity, evicted);
+    vector<uint64_t> evictedVersions;
+    state.thoughtVersions.setCapacity(capacity, evictedVersions);
+    for (size_t i = 0; i < evicted.size(); i++) {
+        state.unarchivedThoughts.push_back({firstThoughtId + i, move(evicted[i].first), move(evicted[i].second)});
+    }
+    
+    if (state.copingStrategies.empty()) {
+        for (const auto& strategy : config.defaultStrategies) {
+            state.copingStrategies.add(strategy);
+        }
+    }
+    if (state.strategyCursor >= state.copingStrategies.size()) state.strategyCursor = 0;
+}
+
+// ---------------------------------------------------------------------------
+// Request timing and metrics
+//
+// Each request splits its wall time into phases with one monotonic clock read
+// per phase change. The split goes back to the browser as a Server-Timing
+// header and is added to cumulative per-action counters and latency
+// histograms in METRICS_FILE. That file is mapped shared by every CGI process
+// and server thread and only ever updated with atomic adds, so recording a
+// request costs a handful of uncontended increments.
+// ---------------------------------------------------------------------------
+
+enum RequestPhase {
+    PHASE_CONFIG,
+    PHASE_LOAD,   // state restore (snapshot + log replay) or the 304 peek
+    PHASE_ACTION, // resolving and applying a mutation
+    PHASE_SAVE,   // log append; snapshot write when compacting
+    PHASE_RENDER,
+    PHASE_COUNT
+};
+
+const char* const PHASE_NAMES[PHASE_COUNT] = {"config", "load", "action", "save", "render"};
+
+// Page views are "view"; compactions are recorded on their own after the
+// response went out. Anything unrecognized counts as "other". Counters are
+// stored in this order, so any change to the list needs a new METRICS_MAGIC.
+const char* const METRIC_ACTIONS[] = {
+    "view", "logMood", "addThought", "suggestStrategy", "useStrategy", "addStrategy",
+    "addCustomStrategy", "searchThoughts", "moodTrends", "history", "import", "export", "metrics", "population",
+    "compaction", "other"
+};
+const size_t METRIC_ACTION_COUNT = sizeof(METRIC_ACTIONS) / sizeof(METRIC_ACTIONS[0]);
+
+// Upper bounds in seconds; one more bucket catches everything slower
+const double LATENCY_BUCKETS[] = {0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5};
+const size_t LATENCY_BUCKET_COUNT = sizeof(LATENCY_BUCKETS) / sizeof(LATENCY_BUCKETS[0]);
+
+const char METRICS_MAGIC[8] = {'M', 'H', 'S', 'M', 'E', 'T', 'R', '2'};
+
+struct ActionMetrics {
+    uint64_t requests;
+    uint64_t totalNs;
+    uint64_t phaseNs[PHASE_COUNT];
+    uint64_t buckets[LATENCY_BUCKET_COUNT + 1]; // not cumulative
+};
+
+struct MetricsBlock {
+    char magic[8];
+    ActionMetrics actions[METRIC_ACTION_COUNT];
+};
+
+size_t metricActionIndex(const string& action) {
+    if (action.empty()) return 0;
+    for (size_t i = 1; i < METRIC_ACTION_COUNT; i++) {
+        if (action == METRIC_ACTIONS[i]) return i;
+    }
+    return METRIC_ACTION_COUNT - 1;
+}
+
+struct RequestTimer {
+    uint64_t phaseNs[PHASE_COUNT] = {};
+    bool ran[PHASE_COUNT] = {};
+    uint64_t startNs = monotonicNs();
+    uint64_t markNs = startNs;
+    int current = -1;
+    
+    // Ends the running phase and starts 'phase' (-1 = none)
+    void enter(int phase) {
+        uint64_t now = monotonicNs();
+        if (current >= 0) phaseNs[current] += now - markNs;
+        markNs = now;
+        current = phase;
+        if (phase >= 0) ran[phase] = true;
+    }
+    
+    uint64_t elapsedNs() const { return monotonicNs() - startNs; }
+    
+    // Phases that ran so far (durations in milliseconds), plus the total
+    string serverTimingHeader() const {
+        string header = "Server-Timing: ";
+        char item[64];
+        for (int phase = 0; phase < PHASE_COUNT; phase++) {
+            if (!ran[phase]) continue;
+            uint64_t ns = phaseNs[phase] + (phase == current ? monotonicNs() - markNs : 0);
+            snprintf(item, sizeof(item), "%s;dur=%.3f, ", PHASE_NAMES[phase], ns / 1e6);
+            header += item;
+        }
+        snprintf(item, sizeof(item), "total;dur=%.3f\r\n", elapsedNs() / 1e6);
+        return header + item;
+    }
+};
+
+// Maps METRICS_FILE, creating or resetting it when the layout does not match.
+// Returns NULL if it cannot be mapped; metrics are then simply not kept.
+MetricsBlock* mapMetricsFile() {
+    int fd = open(METRICS_FILE.c_str(), O_RDWR | O_CREAT, 0644);
+    if (fd < 0) return NULL;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || ((size_t)st.st_size != sizeof(MetricsBlock) && ftruncate(fd, sizeof(MetricsBlock)) != 0)) {
+        close(fd);
+        return NULL;
+    }
+    void* mapped = mmap(NULL, sizeof(MetricsBlock), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mapped == MAP_FAILED) return NULL;
+    MetricsBlock* block = static_cast<MetricsBlock*>(mapped);
+    if (memcmp(block->magic, METRICS_MAGIC, sizeof(METRICS_MAGIC)) != 0) {
+        memset(block->actions, 0, sizeof(block->actions));
+        memcpy(block->magic, METRICS_MAGIC, sizeof(METRICS_MAGIC));
+    }
+    return block;
+}
+
+MetricsBlock* sharedMetrics() {
+    static MetricsBlock* block = mapMetricsFile();
+    return block;
+}
+
+void recordRequestMetrics(size_t action, const RequestTimer& timer) {
+    MetricsBlock* block = sharedMetrics();
+    if (block == NULL) return;
+    ActionMetrics& metrics = block->actions[action];
+    uint64_t total = timer.elapsedNs();
+    size_t bucket = 0;
+    while (bucket < LATENCY_BUCKET_COUNT && total > LATENCY_BUCKETS[bucket] * 1e9) bucket++;
+    __atomic_fetch_add(&metrics.requests, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&metrics.totalNs, total, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&metrics.buckets[bucket], 1, __ATOMIC_RELAXED);
+    for (int phase = 0; phase < PHASE_COUNT; phase++) {
+        if (timer.phaseNs[phase] > 0) __atomic_fetch_add(&metrics.phaseNs[phase], timer.phaseNs[phase], __ATOMIC_RELAXED);
+    }
+}
+
+void appendMetricValue(string& out, const char* name, const string& labels, double value) {
+    char number[32];
+    snprintf(number, sizeof(number), "%.9g", value);
+    out += name;
+    if (!labels.empty()) {
+        out += '{';
+        out += labels;
+        out += '}';
+    }
+    out += ' ';
+    out += number;
+    out += '\n';
+}
+
+// Cumulative counters and histograms in the Prometheus text format
+void appendServerMetrics(string& out) {
+    MetricsBlock* block = sharedMetrics();
+    if (block == NULL) return;
+    ActionMetrics snapshot[METRIC_ACTION_COUNT];
+    for (size_t a = 0; a < METRIC_ACTION_COUNT; a++) {
+        const uint64_t* from = reinterpret_cast<const uint64_t*>(&block->actions[a]);
+        uint64_t* to = reinterpret_cast<uint64_t*>(&snapshot[a]);
+        for (size_t i = 0; i < sizeof(ActionMetrics) / sizeof(uint64_t); i++) to[i] = __atomic_load_n(&from[i], __ATOMIC_RELAXED);
+    }
+    
+    out += "# HELP mhs_requests_total Requests handled, by action.\n# TYPE mhs_requests_total counter\n";
+    for (size_t a = 0; a < METRIC_ACTION_COUNT; a++) {
+        if (snapshot[a].requests == 0) continue;
+        appendMetricValue(out, "mhs_requests_total", string("action=\"") + METRIC_ACTIONS[a] + "\"", snapshot[a].requests);
+    }
+    
+    out += "# HELP mhs_request_duration_seconds Request latency, by action.\n# TYPE mhs_request_duration_seconds histogram\n";
+    for (size_t a = 0; a < METRIC_ACTION_COUNT; a++) {
+        if (snapshot[a].requests == 0) continue;
+        string action = string("action=\"") + METRIC_ACTIONS[a] + "\"";
+        uint64_t cumulative = 0;
+        char bound[32];
+        for (size_t b = 0; b <= LATENCY_BUCKET_COUNT; b++) {
+            cumulative += snapshot[a].buckets[b];
+            if (b < LATENCY_BUCKET_COUNT) snprintf(bound, sizeof(bound), "%g", LATENCY_BUCKETS[b]);
+            else strcpy(bound, "+Inf");
+            appendMetricValue(out, "mhs_request_duration_seconds_bucket", action + ",le=\"" + bound + "\"", cumulative);
+        }
+        appendMetricValue(out, "mhs_request_duration_seconds_sum", action, snapshot[a].totalNs / 1e9);
+        appendMetricValue(out, "mhs_request_duration_seconds_count", action, snapshot[a].requests);
+    }
+    
+    out += "# HELP mhs_phase_seconds_total Time spent per request phase, by action.\n# TYPE mhs_phase_seconds_total counter\n";
+    for (size_t a = 0; a < METRIC_ACTION_COUNT; a++) {
+        if (snapshot[a].requests == 0) continue;
+        for (int phase = 0; phase < PHASE_COUNT; phase++) {
+            if (snapshot[a].phaseNs[phase] == 0) continue;
+            appendMetricValue(out, "mhs_phase_seconds_total",
+                              string("action=\"") + METRIC_ACTIONS[a] + "\",phase=\"" + PHASE_NAMES[phase] + "\"",
+                              snapshot[a].phaseNs[phase] / 1e9);
+        }
+    }
+}
+
+// File sizes and entry counts of the requesting user's state
+void appendStateMetrics(string& out, const StatePaths& paths, const MentalHealthState& state) {
+    out += "# HELP mhs_state_file_bytes Size of this session's state files.\n# TYPE mhs_state_file_bytes gauge\n";
+    const pair<const char*, const string*> files[] = {
+        {"snapshot", &paths.snapshot}, {"log", &paths.log}, {"archive", &paths.archive}, {"index", &paths.thoughtIndex}
+    };
+    for (const auto& file : files) {
+        struct stat st;
+        double bytes = stat(file.second->c_str(), &st) == 0 ? (double)st.st_size : 0;
+        appendMetricValue(out, "mhs_state_file_bytes", string("file=\"") + file.first + "\"", bytes);
+    }
+    
+    out += "# HELP mhs_state_entries Entries in this session's state.\n# TYPE mhs_state_entries gauge\n";
+    appendMetricValue(out, "mhs_state_entries", "kind=\"mood_events\",tier=\"memory\"", state.moodHistory.size());
+    appendMetricValue(out, "mhs_state_entries", "kind=\"mood_events\",tier=\"all\"", state.moodHistory.eventsRecorded);
+    appendMetricValue(out, "mhs_state_entries", "kind=\"thoughts\",tier=\"memory\"", state.thoughtJournal.size());
+    appendMetricValue(out, "mhs_state_entries", "kind=\"thoughts\",tier=\"all\"", state.thoughtsRecorded);
+    appendMetricValue(out, "mhs_state_entries", "kind=\"strategies\",tier=\"memory\"", state.copingStrategies.size());
+    appendMetricValue(out, "mhs_state_entries", "kind=\"unarchived\",tier=\"memory\"",
+                      state.unarchivedMoods.size() + state.unarchivedThoughts.size());
+    appendMetricValue(out, "mhs_state_entries", "kind=\"unindexed_thoughts\",tier=\"memory\"", state.unindexedThoughts.size());
+    out += "# HELP mhs_state_version Mutations applied to this session's state.\n# TYPE mhs_state_version gauge\n";
+    appendMetricValue(out, "mhs_state_version", "", state.version);
+}
+
+// ---------------------------------------------------------------------------
+// Population mood aggregate
+//
+// Every logged or imported mood is also counted in AGGREGATE_FILE, once it
+// is on disk. Every CGI process and server thread maps the file shared, like METRICS_FILE. A thread only
+// adds to its own one of AGGREGATE_SHARDS blocks of counters (all-time, and
+// one slot per day for the last AGGREGATE_DAYS days), so concurrent writers
+// don't fight over cache lines and never take a lock. At most once per
+// AGGREGATE_MERGE_SECONDS the blocks are summed into AGGREGATE_CHECKPOINT,
+// which action=population reads: a fixed amount of work whatever the number
+// of users. If the shared file is lost or its layout changes, it starts again
+// from the last checkpoint.
+// ---------------------------------------------------------------------------
+
+const size_t AGGREGATE_SHARDS = 32;
+const int32_t AGGREGATE_DAYS = 32; // the 30-day window plus the day prepared ahead
+
+const char AGGREGATE_MAGIC[8] = {'M', 'H', 'S', 'P', 'O', 'P', 'L', '1'};
+const char AGGREGATE_CHECKPOINT_MAGIC[8] = {'M', 'H', 'S', 'P', 'C', 'H', 'K', '1'};
+
+typedef array<uint64_t, MOOD_COUNT> PopulationCounts; // indexed by MoodId
+
+struct alignas(64) AggregateShard {
+    uint64_t allTime[MOOD_COUNT];
+    uint64_t days[AGGREGATE_DAYS][MOOD_COUNT]; // slot aggregateSlot(day)
+};
+
+struct AggregateBlock {
+    char magic[8];
+    int32_t preparedDay;   // day slots hold the AGGREGATE_DAYS days ending here
+    int32_t mergedDay;     // preparedDay at the last checkpoint
+    int64_t mergedAt;      // time of the last merge
+    uint64_t mergedEvents; // all-time total at the last checkpoint
+    AggregateShard shards[AGGREGATE_SHARDS];
+};
+
+struct AggregateCheckpoint {
+    char magic[8];
+    int32_t day; // 'days' holds the AGGREGATE_DAYS days ending here
+    int32_t reserved;
+    int64_t mergedAt;
+    uint64_t allTime[MOOD_COUNT];
+    uint64_t days[AGGREGATE_DAYS][MOOD_COUNT];
+};
+
+size_t aggregateSlot(int32_t day) {
+    return (size_t)(((day % AGGREGATE_DAYS) + AGGREGATE_DAYS) % AGGREGATE_DAYS);
+}
+
+bool readAggregateCheckpoint(AggregateCheckpoint& checkpoint) {
+    int fd = open(AGGREGATE_CHECKPOINT.c_str(), O_RDONLY);
+    if (fd < 0) return false;
+    ssize_t n = pread(fd, &checkpoint, sizeof(checkpoint), 0);
+    close(fd);
+    return n == (ssize_t)sizeof(checkpoint) &&
+           memcmp(checkpoint.magic, AGGREGATE_CHECKPOINT_MAGIC, sizeof(AGGREGATE_CHECKPOINT_MAGIC)) == 0;
+}
+
+struct SharedAggregate {
+    AggregateBlock* block = NULL; // NULL if the file cannot be mapped; moods are then not counted
+    int fd = -1;
+    mutex m; // flock() does not keep out other threads using the same descriptor
+    
+    // Maps AGGREGATE_FILE, starting it over from the checkpoint when it is
+    // new or its layout does not match. The flock() keeps two processes
+    // from both seeding it.
+    SharedAggregate() {
+        fd = open(AGGREGATE_FILE.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        if (fd < 0) return;
+        struct stat st;
+        if (flock(fd, LOCK_EX) != 0 || fstat(fd, &st) != 0 ||
+            ((size_t)st.st_size != sizeof(AggregateBlock) && ftruncate(fd, sizeof(AggregateBlock)) != 0)) {
+            close(fd);
+            fd = -1;
+            return;
+        }
+        void* mapped = mmap(NULL, sizeof(AggregateBlock), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (mapped != MAP_FAILED) {
+            block = static_cast<AggregateBlock*>(mapped);
+            if (memcmp(block->magic, AGGREGATE_MAGIC, sizeof(AGGREGATE_MAGIC)) != 0) {
+                memset((char*)block + sizeof(block->magic), 0, sizeof(AggregateBlock) - sizeof(block->magic));
+                AggregateCheckpoint checkpoint;
+                if (readAggregateCheckpoint(checkpoint)) {
+                    memcpy(block->shards[0].allTime, checkpoint.allTime, sizeof(checkpoint.allTime));
+                    memcpy(block->shards[0].days, checkpoint.days, sizeof(checkpoint.days));
+                    block->preparedDay = block->mergedDay = checkpoint.day;
+                    block->mergedAt = checkpoint.mergedAt;
+                    for (uint64_t count : checkpoint.allTime) block->mergedEvents += count;
+                }
+                memcpy(block->magic, AGGREGATE_MAGIC, sizeof(AGGREGATE_MAGIC));
+            }
+        }
+        flock(fd, LOCK_UN);
+    }
+};
+
+SharedAggregate& sharedAggregate() {
+    static SharedAggregate shared;
+    return shared;
+}
+
+// Threads of one process take consecutive shards, starting from the pid so
+// that CGI processes spread out too
+size_t aggregateShardIndex() {
+    static size_t nextShard = (size_t)getpid();
+    thread_local size_t index = __atomic_fetch_add(&nextShard, 1, __ATOMIC_RELAXED) % AGGREGATE_SHARDS;
+    return index;
+}
+
+// Runs 'work' on the block while holding it exclusively against other
+// threads and processes. Without 'wait' it gives up if someone else has it.
+template <typename Work>
+bool withAggregateLocked(SharedAggregate& shared, bool wait, Work work) {
+    unique_lock<mutex> lock(shared.m, defer_lock);
+    if (wait) lock.lock();
+    else if (!lock.try_lock()) return false;
+    while (flock(shared.fd, wait ? LOCK_EX : LOCK_EX | LOCK_NB) != 0) {
+        if (errno != EINTR) return false;
+    }
+    work(shared.block);
+    flock(shared.fd, LOCK_UN);
+    return true;
+}
+
+// Clears the day slots that 'day' and the days before it take over from
+// days that left the window. Writers never touch slots past preparedDay, so
+// nobody is counting into the slots being cleared.
+void prepareAggregateDays(AggregateBlock* block, int32_t day) {
+    int32_t prepared = __atomic_load_n(&block->preparedDay, __ATOMIC_RELAXED);
+    if (day <= prepared) return;
+    for (int32_t d = max(prepared + 1, day - AGGREGATE_DAYS + 1); d <= day; d++) {
+        for (AggregateShard& shard : block->shards) {
+            for (size_t id = 0; id < MOOD_COUNT; id++) __atomic_store_n(&shard.days[aggregateSlot(d)][id], 0, __ATOMIC_RELAXED);
+        }
+    }
+    __atomic_store_n(&block->preparedDay, day, __ATOMIC_RELEASE);
+}
+
+// Counts one logged mood: two atomic adds, plus a locked slot clear for the
+// first mood of a day nobody has prepared yet. Imported moods can be dated
+// in the future; they count towards the all-time totals only.
+void countPopulationMood(time_t when, MoodId mood) {
+    SharedAggregate& shared = sharedAggregate();
+    if (shared.block == NULL || mood >= MOOD_COUNT) return;
+    int32_t day = localDay(when);
+    if (day > __atomic_load_n(&shared.block->preparedDay, __ATOMIC_ACQUIRE) && day <= localDay(time(0)) + 1) {
+        withAggregateLocked(shared, true, [day](AggregateBlock* block) { prepareAggregateDays(block, day); });
+    }
+    AggregateShard& shard = shared.block->shards[aggregateShardIndex()];
+    __atomic_fetch_add(&shard.allTime[mood], 1, __ATOMIC_RELAXED);
+    int32_t prepared = __atomic_load_n(&shared.block->preparedDay, __ATOMIC_ACQUIRE);
+    if (day <= prepared && day > prepared - AGGREGATE_DAYS) {
+        __atomic_fetch_add(&shard.days[aggregateSlot(day)][mood], 1, __ATOMIC_RELAXED);
+    }
+}
+
+bool populationMergeDue() {
+    SharedAggregate& shared = sharedAggregate();
+    return shared.block != NULL &&
+           time(0) - __atomic_load_n(&shared.block->mergedAt, __ATOMIC_RELAXED) >= AGGREGATE_MERGE_SECONDS;
+}
+
+// Sums the shards into AGGREGATE_CHECKPOINT (skipped when nothing changed)
+// and prepares tomorrow's day slot ahead of its first mood. Without 'wait'
+// it leaves the merge to whoever is already doing one.
+bool mergePopulationMoods(bool wait) {
+    SharedAggregate& shared = sharedAggregate();
+    if (shared.block == NULL) return false;
+    bool ok = true;
+    bool locked = withAggregateLocked(shared, wait, [&ok](AggregateBlock* block) {
+        time_t now = time(0);
+        prepareAggregateDays(block, localDay(now) + 1);
+        AggregateCheckpoint checkpoint = {};
+        memcpy(checkpoint.magic, AGGREGATE_CHECKPOINT_MAGIC, sizeof(AGGREGATE_CHECKPOINT_MAGIC));
+        checkpoint.day = block->preparedDay;
+        checkpoint.mergedAt = now;
+        uint64_t events = 0;
+        for (const AggregateShard& shard : block->shards) {
+            for (size_t id = 0; id < MOOD_COUNT; id++) {
+                uint64_t count = __atomic_load_n(&shard.allTime[id], __ATOMIC_RELAXED);
+                checkpoint.allTime[id] += count;
+                events += count;
+                for (int32_t slot = 0; slot < AGGREGATE_DAYS; slot++) {
+                    checkpoint.days[slot][id] += __atomic_load_n(&shard.days[slot][id], __ATOMIC_RELAXED);
+                }
+            }
+        }
+        if (events != block->mergedEvents || checkpoint.day != block->mergedDay) {
+            ok = replaceFile(AGGREGATE_CHECKPOINT, string((const char*)&checkpoint, sizeof(checkpoint)));
+            if (!ok) return;
+            block->mergedEvents = events;
+            block->mergedDay = checkpoint.day;
+        }
+        __atomic_store_n(&block->mergedAt, (int64_t)now, __ATOMIC_RELAXED);
+    });
+    return locked && ok;
+}
+
+// Server mode: keeps the checkpoint at most AGGREGATE_MERGE_SECONDS behind
+void runAggregator() {
+    while (true) {
+        this_thread::sleep_for(chrono::seconds(AGGREGATE_MERGE_SECONDS));
+        if (populationMergeDue()) mergePopulationMoods(false);
+    }
+}
+
+// Counts per mood over days first..last, as far as the checkpoint reaches back
+PopulationCounts checkpointWindow(const AggregateCheckpoint& checkpoint, int32_t first, int32_t last) {
+    PopulationCounts counts = {};
+    first = max(first, checkpoint.day - AGGREGATE_DAYS + 1);
+    last = min(last, checkpoint.day);
+    for (int32_t day = first; day <= last; day++) {
+        for (size_t id = 0; id < MOOD_COUNT; id++) counts[id] += checkpoint.days[aggregateSlot(day)][id];
+    }
+    return counts;
+}
+
+// ---------------------------------------------------------------------------
+// Mutation log
+//
+// Every action is stored as one line appended to LOG_FILE instead of
+// rewriting the whole state file. Arguments are resolved before they are
+// logged (the random strategy, the thought timestamp, the time a strategy was
+// used), so replaying the log always rebuilds exactly the same state.
+// Once the log grows past LOG_COMPACT_BYTES it is folded into a new snapshot.
+// ---------------------------------------------------------------------------
+
+struct Mutation {
+    unsigned long long seq = 0;
+    string op;
+    time_t time = 0;
+    string arg;
+    string extra;
+};
+
+string escapeLogField(const string& field) {
+    string escaped;
+    escaped.reserve(field.size());
+    for (char c : field) {
+        if (c == '\\') escaped += "\\\\";
+        else if (c == '\t') escaped += "\\t";
+        else if (c == '\n') escaped += "\\n";
+        else if (c == '\r') escaped += "\\r";
+        else escaped += c;
+    }
+    return escaped;
+}
+
+string unescapeLogField(const string& field) {
+    string plain;
+    plain.reserve(field.size());
+    for (size_t i = 0; i < field.size(); i++) {
+        if (field[i] == '\\' && i + 1 < field.size()) {
+            char next = field[++i];
+            plain += next == 't' ? '\t' : next == 'n' ? '\n' : next == 'r' ? '\r' : next;
+        } else {
+            plain += field[i];
+        }
+    }
+    return plain;
+}
+
+// Record layout: seq <TAB> op <TAB> time <TAB> arg <TAB> extra <LF>
+string formatMutation(const Mutation& m) {
+    return to_string(m.seq) + "\t" + m.op + "\t" + to_string((long long)m.time) + "\t" +
+           escapeLogField(m.arg) + "\t" + escapeLogField(m.extra) + "\n";
+}
+
+bool parseMutation(const string& line, Mutation& m) {
+    size_t fields[4];
+    size_t pos = 0;
+    for (int i = 0; i < 4; i++) {
+        pos = line.find('\t', pos);
+        if (pos == string::npos) return false;
+        fields[i] = pos++;
+    }
+    m.seq = strtoull(line.c_str(), NULL, 10);
+    m.op = line.substr(fields[0] + 1, fields[1] - fields[0] - 1);
+    m.time = (time_t)strtoll(line.c_str() + fields[1] + 1, NULL, 10);
+    m.arg = unescapeLogField(line.substr(fields[2] + 1, fields[3] - fields[2] - 1));
+    m.extra = unescapeLogField(line.substr(fields[3] + 1));
+    return m.seq > 0 && !m.op.empty();
+}
+
+// Actions that may append to the log. Everything else only reads: it takes
+// no exclusive lock, creates nothing and writes nothing.
+bool isMutatingAction(string_view action) {
+    return action == "logMood" || action == "addThought" || action == "suggestStrategy" || action == "useStrategy" ||
+           action == "addStrategy" || action == "addCustomStrategy" || action == "import";
+}
+
+mt19937_64& strategyRandom() {
+    thread_local mt19937_64 random(random_device{}());
+    return random;
+}
+
+// Turns a request into a fully resolved mutation. Returns false when the
+// request does not change anything.
+bool resolveAction(const MentalHealthState& state, const AppConfig& config, const RequestParams& params, Mutation& m) {
+    const string& action = params.action;
+    m.op = action;
+    m.time = time(0);
+    
+    if (action == "logMood" && moodIdFor(params.moodInput) != UNKNOWN_MOOD) {
+        m.arg = params.moodInput;
+        return true;
+    }
+    if (action == "addThought" && !params.thoughtInput.empty()) {
+        m.arg = params.thoughtInput;
+        m.extra = config.enableTimestamps ? getTimestamp() : "";
+        return true;
+    }
+    if (action == "suggestStrategy" && !state.copingStrategies.empty()) {
+        // Drawn here and logged by id, so replaying the log picks the same one
+        m.arg = to_string(state.copingStrategies.sample(strategyRandom()) + 1);
+        return true;
+    }
+    if (action == "useStrategy" && !state.copingStrategies.empty()) {
+        return true;
+    }
+    if (action == "addStrategy") {
+        // A default the user doesn't have yet
+        vector<const string*> missing;
+        for (const auto& strategy : config.defaultStrategies) {
+            if (state.copingStrategies.find(strategy) == StrategyStore::NOT_FOUND) missing.push_back(&strategy);
+        }
+        if (missing.empty() || state.copingStrategies.size() >= MAX_STRATEGIES) return false;
+        m.arg = *missing[uniform_int_distribution<size_t>(0, missing.size() - 1)(strategyRandom())];
+        return true;
+    }
+    if (action == "addCustomStrategy" && !params.newStrategy.empty() && params.newStrategy.size() <= MAX_STRATEGY_BYTES &&
+        state.copingStrategies.size() < MAX_STRATEGIES &&
+        state.copingStrategies.find(params.newStrategy) == StrategyStore::NOT_FOUND) {
+        m.arg = params.newStrategy;
+        return true;
+    }
+    return false;
+}
+
+void applyMutation(MentalHealthState& state, const Mutation& m) {
+    if (m.op == "logMood") {
+        // Unknown names only come from a damaged log; the record is skipped
+        MoodId mood = moodIdFor(m.arg);
+        if (mood != UNKNOWN_MOOD) {
+            state.moodStatistics[mood]++;
+            MoodEvent evicted;
+            if (state.moodHistory.record(m.time, mood, m.seq, evicted)) state.unarchivedMoods.push_back(evicted);
+            state.currentMood = mood;
+            state.currentMoodTime = m.time;
+        }
+    }
+    else if (m.op == "addThought") {
+        pair<string, string> evicted;
+        if (state.thoughtJournal.push_back({m.arg, m.extra}, &evicted)) {
+            unsigned long long evictedId = state.thoughtsRecorded - state.thoughtJournal.size() + 1;
+            state.unarchivedThoughts.push_back({evictedId, move(evicted.first), move(evicted.second)});
+        }
+        state.thoughtVersions.push_back(m.seq);
+        state.thoughtsRecorded++;
+        state.unindexedThoughts.push_back({state.thoughtsRecorded, m.arg});
+    }
+    else if (m.op == "suggestStrategy" && !state.copingStrategies.empty()) {
+        // Records from before weighted suggestions carry no id and just
+        // moved on to the next strategy
+        size_t total = state.copingStrategies.size();
+        unsigned long long id = strtoull(m.arg.c_str(), NULL, 10);
+        state.strategyCursor = id >= 1 && id <= total ? id - 1 : (state.strategyCursor + 1) % total;
+        state.strategiesVersion = m.seq;
+    }
+    else if (m.op == "useStrategy" && !state.copingStrategies.empty()) {
+        state.copingStrategies.use(state.strategyCursor, m.time);
+        state.lastStrategyUsed = state.copingStrategies[state.strategyCursor].text;
+        state.lastStrategyTime = m.time;
+    }
+    else if (m.op == "addStrategy" || m.op == "addCustomStrategy") {
+        // Imports carry the use count in 'extra' and the last use in 'time'
+        uint32_t uses = (uint32_t)min<unsigned long>(strtoul(m.extra.c_str(), NULL, 10), UINT32_MAX);
+        size_t known = state.copingStrategies.find(m.arg);
+        if (known != StrategyStore::NOT_FOUND) {
+            if (uses > 0) state.copingStrategies.mergeUsage(known, uses, m.time);
+        } else if (state.copingStrategies.add(m.arg, uses, uses > 0 ? m.time : 0)) {
+            state.strategiesVersion = m.seq;
+        }
+    }
+    state.version = m.seq;
+}
+
+struct LogAppend {
+    int fd = -1;          // the log, still open; -1 if the append failed
+    bool newFile = false; // the record started the file, so its directory entry is new too
+};
+
+// Appends one record and leaves the log open so the caller can make the
+// record durable before acknowledging it: syncLogAppend() right away, or a
+// GroupCommit in server mode.
+LogAppend appendToLog(const StatePaths& paths, const string& record) {
+    LogAppend append;
+    append.fd = open(paths.log.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (append.fd < 0) return append;
+    struct stat st;
+    append.newFile = fstat(append.fd, &st) == 0 && st.st_size == 0;
+    // One write() per record so concurrent appenders never interleave lines
+    ssize_t n = write(append.fd, record.data(), record.size());
+    if (n != (ssize_t)record.size()) {
+        close(append.fd);
+        append.fd = -1;
+    }
+    return append;
+}
+
+bool syncLogAppend(const StatePaths& paths, const LogAppend& append) {
+    bool ok = fdatasync(append.fd) == 0;
+    ok = (close(append.fd) == 0) && ok;
+    return ok && (!append.newFile || syncDirectory(paths.dir));
+}
+
+// Server mode: records appended by concurrent requests are made durable
+// together. The first record of a batch waits GROUP_COMMIT_WINDOW for
+// company, then the syncer fdatasync()s every log written meanwhile (and
+// the directory of each log a record started) and acknowledges the whole
+// batch at once. Records arriving while a sync runs form the next batch.
+struct PendingLog {
+    int fd;
+    string newFileDir; // set if the record started the log: the directory to sync too
+};
+
+struct GroupCommit {
+    mutex m;
+    condition_variable wake;   // the syncer: records are waiting
+    condition_variable synced; // requests: a batch is on disk
+    vector<PendingLog> pending; // logs appended to since the last sync, still open
+    unsigned long long nextBatch = 1;
+    unsigned long long syncedBatch = 0;
+    // A failed fsync may have dropped the dirty pages, so retrying cannot
+    // tell whether earlier records survived. Every later commit fails too
+    // until the server is restarted and recovers from what is on disk.
+    bool failed = false;
+    
+    // Takes over the log's fd; returns the batch to wait for
+    unsigned long long submit(const StatePaths& paths, const LogAppend& append) {
+        unsigned long long batch;
+        {
+            lock_guard<mutex> lock(m);
+            pending.push_back({append.fd, append.newFile ? paths.dir : string()});
+            batch = nextBatch;
+        }
+        wake.notify_one();
+        return batch;
+    }
+    
+    // True once the batch is durable
+    bool wait(unsigned long long batch) {
+        unique_lock<mutex> lock(m);
+        synced.wait(lock, [this, batch] { return syncedBatch >= batch; });
+        return !failed;
+    }
+};
+
+void runGroupCommit(GroupCommit& commits) {
+    while (true) {
+        {
+            unique_lock<mutex> lock(commits.m);
+            commits.wake.wait(lock, [&commits] { return !commits.pending.empty(); });
+        }
+        this_thread::sleep_for(GROUP_COMMIT_WINDOW);
+        vector<PendingLog> logs;
+        unsigned long long batch;
+        {
+            lock_guard<mutex> lock(commits.m);
+            logs.swap(commits.pending);
+            batch = commits.nextBatch++;
+        }
+        int error = 0; // the first failure's errno
+        unordered_set<string> newFileDirs;
+        for (const PendingLog& log : logs) {
+            if (fdatasync(log.fd) != 0 && error == 0) error = errno;
+            if (close(log.fd) != 0 && error == 0) error = errno;
+            if (!log.newFileDir.empty()) newFileDirs.insert(log.newFileDir);
+        }
+        for (const string& dir : newFileDirs) {
+            if (!syncDirectory(dir) && error == 0) error = errno;
+        }
+        {
+            lock_guard<mutex> lock(commits.m);
+            if (error != 0 && !commits.failed) {
+                cerr << "log sync failed: " << strerror(error) << "; refusing further writes" << endl;
+                commits.failed = true;
+            }
+            commits.syncedBatch = batch;
+        }
+        commits.synced.notify_all();
+    }
+}
+
+void replayLogFile(const string& path, MentalHealthState& state) {
+    ifstream file(path, ios::binary);
+    if (!file.is_open()) return;
+    string contents((istreambuf_iterator<char>(file)), istreambuf_iterator<char>());
+    
+    size_t pos = 0;
+    size_t eol;
+    // A record without its trailing newline is a torn write and is ignored
+    while ((eol = contents.find('\n', pos)) != string::npos) {
+        Mutation m;
+        if (parseMutation(contents.substr(pos, eol - pos), m) && m.seq > state.version) {
+            applyMutation(state, m);
+        }
+        pos = eol + 1;
+    }
+}
+
+// Snapshot + whatever was logged after it. False if the snapshot is unreadable.
+bool restoreState(const StatePaths& paths, const AppConfig& config, MentalHealthState& state) {
+    if (access(paths.snapshot.c_str(), F_OK) != 0 && loadLegacyState(paths, state)) {
+        // One-time migration from the text format
+        prepareState(state, config);
+        if (saveState(paths, state)) {
+            rename(paths.legacyText.c_str(), (paths.legacyText + ".migrated").c_str());
+        }
+    } else {
+        if (!loadState(paths, state)) return false;
+        prepareState(state, config);
+    }
+    replayLogFile(paths.compactingLog, state);
+    replayLogFile(paths.log, state);
+    return true;
+}
+
+enum ActionResult {
+    ACTION_NONE,    // nothing to do
+    ACTION_APPLIED,
+    ACTION_FAILED   // applied in memory, but the record may not be on disk
+};
+
+// Dispatches one request: resolves it, applies it and appends it to the log.
+// Without 'commits' (CGI) the record is synced before this returns. In server
+// mode it joins a group commit and the caller waits for '*batch' before
+// answering.
+ActionResult handleAction(MentalHealthState& state, const StatePaths& paths, const AppConfig& config,
+                          const RequestParams& params, RequestTimer& timer, GroupCommit* commits = NULL,
+                          unsigned long long* batch = NULL) {
+    timer.enter(PHASE_ACTION);
+    Mutation m;
+    if (!resolveAction(state, config, params, m)) return ACTION_NONE;
+    m.seq = state.version + 1;
+    applyMutation(state, m);
+    timer.enter(PHASE_SAVE);
+    LogAppend append = appendToLog(paths, formatMutation(m));
+    if (append.fd < 0) return ACTION_FAILED;
+    if (commits != NULL) {
+        // The caller counts a logged mood once the batch is on disk
+        *batch = commits->submit(paths, append);
+        return ACTION_APPLIED;
+    }
+    if (!syncLogAppend(paths, append)) return ACTION_FAILED;
+    if (m.op == "logMood") countPopulationMood(m.time, moodIdFor(m.arg));
+    return ACTION_APPLIED;
+}
+
+bool logNeedsCompaction(const StatePaths& paths) {
+    struct stat st;
+    return stat(paths.log.c_str(), &st) == 0 && (size_t)st.st_size > LOG_COMPACT_BYTES;
+}
+
+// Step one of a compaction, called while no other mutation can be logged:
+// move the current log aside so new records start a fresh file. If an older
+// compaction was interrupted the aside file is still there; in that case the
+// live log is left alone and its records are skipped by sequence number later.
+void beginCompaction(const StatePaths& paths) {
+    if (access(paths.compactingLog.c_str(), F_OK) != 0) {
+        rename(paths.log.c_str(), paths.compactingLog.c_str());
+    }
+}
+
+// Step two, may run concurrently with new mutations: write a snapshot of the
+// state as it was at beginCompaction() and drop the log it replaces.
+bool finishCompaction(const StatePaths& paths, const MentalHealthState& snapshot) {
+    // An import may have committed a newer snapshot in the meantime
+    SnapshotView current;
+    if (!current.open(paths.snapshot) || current.version() < snapshot.version) {
+        current.release();
+        if (!saveState(paths, snapshot)) return false;
+    }
+    unlink(paths.compactingLog.c_str());
+    return true;
+}
+
+// Builds the read-only parts of a response that depend on the request.
+PageExtras preparePageExtras(const StatePaths& paths, const MentalHealthState& state, const RequestParams& params,
+                              const AppConfig& config) {
+    PageExtras extras;
+    extras.showTrends = params.action == "moodTrends";
+    if (params.action == "searchThoughts") {
+        extras.searched = true;
+        extras.searchQuery = params.searchQuery;
+        vector<uint32_t> matches = searchThoughts(paths, state, params.searchQuery, MAX_SEARCH_RESULTS);
+        vector<unsigned long long> ids(matches.rbegin(), matches.rend());
+        map<unsigned long long, JournalEntry> found = collectThoughts(paths, state, ids);
+        for (uint32_t id : matches) {
+            auto it = found.find(id);
+            if (it != found.end()) {
+                extras.searchResults.push_back({it->second.thought, it->second.timestamp});
+            } else {
+                extras.searchResultsDropped++;
+            }
+        }
+    }
+    if (params.action == "history") {
+        // A page is a contiguous id range: ring slots, a few archive segments
+        // found through the archive index, or a slice of the strategy list
+        size_t size = params.pageSize > 0 ? params.pageSize : (size_t)max(1, config.pageSize);
+        size = min(size, MAX_PAGE_SIZE);
+        extras.historyPageSize = params.pageSize > 0 ? size : 0;
+        unsigned long long cursor = params.historyCursor;
+        if (params.historyKind == "strategies") {
+            extras.historyKind = "strategies";
+            unsigned long long total = state.copingStrategies.size();
+            unsigned long long first = max<unsigned long long>(cursor, 1);
+            if (first <= total) {
+                extras.historyFirst = first;
+                extras.historyLast = min(total, first + size - 1);
+                for (unsigned long long id = first; id <= extras.historyLast; id++) {
+                    extras.historyStrategies.push_back({id, state.copingStrategies[id - 1]});
+                }
+                if (extras.historyLast < total) extras.historyNextCursor = extras.historyLast + 1;
+            }
+            if (first > 1) extras.historyPrevCursor = first > size ? min(first - size, max<unsigned long long>(total, 1)) : 1;
+        } else {
+            bool moods = params.historyKind != "thoughts";
+            unsigned long long total = moods ? state.moodHistory.eventsRecorded : state.thoughtsRecorded;
+            extras.historyKind = moods ? "moods" : "thoughts";
+            unsigned long long newest = cursor == 0 ? total : min(cursor, total);
+            if (newest > 0) {
+                unsigned long long oldest = newest > size ? newest - size + 1 : 1;
+                extras.historyFirst = oldest;
+                extras.historyLast = newest;
+                vector<unsigned long long> ids;
+                for (unsigned long long id = oldest; id <= newest; id++) ids.push_back(id);
+                if (moods) {
+                    map<unsigned long long, MoodEvent> found = collectMoods(paths, state, ids);
+                    for (auto it = found.rbegin(); it != found.rend(); ++it) extras.historyMoods.push_back(it->second);
+                } else {
+                    map<unsigned long long, JournalEntry> found = collectThoughts(paths, state, ids);
+                    for (auto it = found.rbegin(); it != found.rend(); ++it) extras.historyThoughts.push_back(it->second);
+                }
+                if (newest < total) extras.historyPrevCursor = min(total, newest + size);
+                if (oldest > 1) extras.historyNextCursor = oldest - 1;
+            }
+        }
+    }
+    return extras;
+}
+
+// ---------------------------------------------------------------------------
+// Bulk import and export
+//
+// Both directions use one record per line, as CSV or as JSON objects (JSONL):
+//   type,time,value,extra
+//   mood,1700000000,Happy,
+//   thought,,"Slept well, finally",2023-11-14 22:13
+//   strategy,,Take a walk,
+//   {"type":"mood","time":1700000000,"value":"Happy"}
+// An import streams its body through the parser and applies the records
+// IMPORT_BATCH_ENTRIES at a time. Each batch is committed once, by writing a
+// snapshot the way a compaction does, instead of appending one log record
+// per entry. An export walks the archive segment by segment and then the
+// in-memory rings, so neither side holds the whole history at once.
+// ---------------------------------------------------------------------------
+
+struct ImportRecord {
+    string type;
+    string time;
+    string value;
+    string extra;
+};
+
+struct ImportSummary {
+    size_t moods = 0;
+    size_t thoughts = 0;
+    size_t strategies = 0;
+    size_t rejected = 0;
+    size_t batches = 0;
+    bool failed = false; // a batch could not be committed; later records were not read
+};
+
+// A request body read incrementally: bytes that already arrived first, then
+// the rest from the descriptor, never past Content-Length.
+struct BodySource {
+    int fd = -1;
+    string_view buffered;
+    size_t remaining = 0; // bytes still to deliver, including 'buffered'
+    
+    size_t read(char* out, size_t n) {
+        n = min(n, remaining);
+        if (!buffered.empty()) {
+            n = min(n, buffered.size());
+            memcpy(out, buffered.data(), n);
+            buffered.remove_prefix(n);
+        } else {
+            ssize_t got;
+            do {
+                got = fd < 0 ? 0 : ::read(fd, out, n);
+            } while (got < 0 && errno == EINTR);
+            n = got > 0 ? got : 0;
+        }
+        remaining = n == 0 ? 0 : remaining - n;
+        return n;
+    }
+};
+
+void appendUtf8(string& out, uint32_t cp) {
+    if (cp < 0x80) {
+        out += (char)cp;
+    } else if (cp < 0x800) {
+        out += (char)(0xC0 | (cp >> 6));
+        out += (char)(0x80 | (cp & 0x3F));
+    } else if (cp < 0x10000) {
+        out += (char)(0xE0 | (cp >> 12));
+        out += (char)(0x80 | ((cp >> 6) & 0x3F));
+        out += (char)(0x80 | (cp & 0x3F));
+    } else {
+        out += (char)(0xF0 | (cp >> 18));
+        out += (char)(0x80 | ((cp >> 12) & 0x3F));
+        out += (char)(0x80 | ((cp >> 6) & 0x3F));
+        out += (char)(0x80 | (cp & 0x3F));
+    }
+}
+
+bool parseJsonHex4(string_view in, size_t& pos, uint32_t& value) {
+    if (pos + 4 > in.size()) return false;
+    value = 0;
+    for (int i = 0; i < 4; i++) {
+        int digit = hexValue(in[pos++]);
+        if (digit < 0) return false;
+        value = value * 16 + digit;
+    }
+    return true;
+}
+
+bool parseJsonString(string_view in, size_t& pos, string& value) {
+    value.clear();
+    if (pos >= in.size() || in[pos++] != '"') return false;
+    while (pos < in.size()) {
+        char c = in[pos++];
+        if (c == '"') return true;
+        if (c != '\\') {
+            value += c;
+            continue;
+        }
+        if (pos >= in.size()) return false;
+        char escaped = in[pos++];
+        switch (escaped) {
+            case 'n': value += '\n'; break;
+            case 't': value += '\t'; break;
+            case 'r': value += '\r'; break;
+            case 'b': value += '\b'; break;
+            case 'f': value += '\f'; break;
+            case 'u': {
+                uint32_t cp, low;
+                if (!parseJsonHex4(in, pos, cp)) return false;
+                if (cp >= 0xD800 && cp < 0xDC00 && in.substr(pos, 2) == "\\u") {
+                    pos += 2;
+                    if (!parseJsonHex4(in, pos, low) || low < 0xDC00 || low >= 0xE000) return false;
+                    cp = 0x10000 + ((cp - 0xD800) << 10) + (low - 0xDC00);
+                }
+                appendUtf8(value, cp);
+                break;
+            }
+            default: value += escaped; // \" \\ \/
+        }
+    }
+    return false;
+}
+
+// One flat JSON object with string, number or null values. Keys other than
+// type/time/value/extra are ignored.
+bool parseJsonRecord(string_view line, ImportRecord& record) {
+    size_t pos = 0;
+    auto skipSpace = [&] { while (pos < line.size() && isspace((unsigned char)line[pos])) pos++; };
+    skipSpace();
+    if (pos >= line.size() || line[pos++] != '{') return false;
+    skipSpace();
+    if (pos < line.size() && line[pos] == '}') return true;
+    string key, value;
+    while (true) {
+        skipSpace();
+        if (!parseJsonString(line, pos, key)) return false;
+        skipSpace();
+        if (pos >= line.size() || line[pos++] != ':') return false;
+        skipSpace();
+        if (pos < line.size() && line[pos] == '"') {
+            if (!parseJsonString(line, pos, value)) return false;
+        } else {
+            size_t start = pos;
+            while (pos < line.size() && line[pos] != ',' && line[pos] != '}' && !isspace((unsigned char)line[pos])) pos++;
+            value.assign(line.data() + start, pos - start);
+            if (value.empty()) return false;
+            if (value == "null") value.clear();
+        }
+        if (key == "type") record.type = value;
+        else if (key == "time") record.time = value;
+        else if (key == "value") record.value = value;
+        else if (key == "extra") record.extra = value;
+        skipSpace();
+        if (pos >= line.size()) return false;
+        char c = line[pos++];
+        if (c == '}') break;
+        if (c != ',') return false;
+    }
+    skipSpace();
+    return pos == line.size();
+}
+
+// Incremental record splitter for both formats. CSV fields may be quoted
+// ("" escapes a quote) and then contain commas and line breaks. A record
+// longer than IMPORT_MAX_RECORD_BYTES is dropped as rejected instead of
+// growing the buffers without bound.
+struct ImportParser {
+    bool jsonl = false;
+    vector<string> fields = vector<string>(1);
+    string line;
+    bool inQuotes = false;
+    bool quoteSeen = false; // the previous byte closed a quoted section
+    size_t recordBytes = 0;
+    bool oversized = false;
+    
+    template <typename Visitor>
+    void feed(const char* data, size_t n, Visitor visit) {
+        for (size_t i = 0; i < n; i++) {
+            char c = data[i];
+            if (c == '\n' && (jsonl || !inQuotes)) {
+                endRecord(visit);
+                continue;
+            }
+            if (++recordBytes > IMPORT_MAX_RECORD_BYTES) {
+                oversized = true;
+                continue;
+            }
+            if (jsonl) {
+                line += c;
+            } else if (inQuotes) {
+                if (c == '"') {
+                    inQuotes = false;
+                    quoteSeen = true;
+                } else {
+                    fields.back() += c;
+                }
+            } else if (c == '"') {
+                if (quoteSeen) fields.back() += '"';
+                inQuotes = true;
+                quoteSeen = false;
+            } else if (c == ',') {
+                fields.emplace_back();
+                quoteSeen = false;
+            } else if (c != '\r') {
+                fields.back() += c;
+                quoteSeen = false;
+            }
+        }
+    }
+    
+    template <typename Visitor>
+    void finish(Visitor visit) {
+        if (recordBytes > 0) endRecord(visit);
+    }
+    
+    // visit(record) for a parsed record, visit(nullptr) for a rejected one
+    template <typename Visitor>
+    void endRecord(Visitor visit) {
+        bool blank = jsonl ? line.find_first_not_of(" \t\r") == string::npos
+                           : fields.size() == 1 && fields[0].empty() && !quoteSeen;
+        if (oversized) {
+            visit(nullptr);
+        } else if (!blank) {
+            ImportRecord record;
+            bool ok = true;
+            if (jsonl) {
+                ok = parseJsonRecord(line, record);
+            } else {
+                fields.resize(max<size_t>(fields.size(), 4));
+                record = {move(fields[0]), move(fields[1]), move(fields[2]), move(fields[3])};
+            }
+            // The CSV header line is allowed and skipped
+            if (!(ok && !jsonl && record.type == "type")) visit(ok ? &record : nullptr);
+        }
+        fields.assign(1, string());
+        line.clear();
+        inQuotes = quoteSeen = oversized = false;
+        recordBytes = 0;
+    }
+};
+
+// The mutation an imported record stands for; false if it is not valid
+bool importMutation(const ImportRecord& record, Mutation& m) {
+    char* end = NULL;
+    long long when = strtoll(record.time.c_str(), &end, 10);
+    bool hasTime = !record.time.empty() && *end == '\0' && when > 0;
+    if (!record.time.empty() && !hasTime) return false;
+    m.time = hasTime ? (time_t)when : time(0);
+    
+    if (record.type == "mood" && moodIdFor(record.value) != UNKNOWN_MOOD) {
+        m.op = "logMood";
+        m.arg = record.value;
+        return true;
+    }
+    if (record.type == "thought" && !record.value.empty()) {
+        m.op = "addThought";
+        m.arg = record.value;
+        m.extra = !record.extra.empty() ? record.extra : hasTime ? formatTimestamp(m.time) : "";
+        return true;
+    }
+    if (record.type == "strategy" && !record.value.empty() && record.value.size() <= MAX_STRATEGY_BYTES &&
+        record.extra.find_first_not_of("0123456789") == string::npos) {
+        m.op = "addCustomStrategy";
+        m.arg = record.value;
+        m.extra = record.extra; // use count
+        return true;
+    }
+    return false;
+}
+
+// Applies a batch and commits it with a snapshot, like a compaction. The
+// caller holds the user's lock; in server mode also the shard's snapshot lock.
+bool commitImportBatch(MentalHealthState& state, const StatePaths& paths, const vector<Mutation>& batch) {
+    for (Mutation m : batch) {
+        m.seq = state.version + 1;
+        // An imported mood older than the current one is history; it goes
+        // into the statistics but doesn't replace the current mood
+        MoodId currentMood = state.currentMood;
+        int64_t currentMoodTime = state.currentMoodTime;
+        applyMutation(state, m);
+        if (m.op == "logMood" && m.time < currentMoodTime) {
+            state.currentMood = currentMood;
+            state.currentMoodTime = currentMoodTime;
+        }
+    }
+    beginCompaction(paths);
+    if (!finishCompaction(paths, state)) return false;
+    // All of these are in the archive, the index or the snapshot now
+    state.unarchivedMoods.clear();
+    state.unarchivedThoughts.clear();
+    state.unindexedThoughts.clear();
+    for (const Mutation& m : batch) {
+        if (m.op == "logMood") countPopulationMood(m.time, moodIdFor(m.arg));
+    }
+    return true;
+}
+
+// Reads the whole body, handing full batches of mutations to commit(batch).
+template <typename Commit>
+ImportSummary importRecords(BodySource& body, bool jsonl, Commit commit) {
+    ImportSummary summary;
+    ImportParser parser;
+    parser.jsonl = jsonl;
+    vector<Mutation> batch;
+    auto flush = [&] {
+        if (batch.empty() || summary.failed) return;
+        if (commit(batch)) summary.batches++;
+        else summary.failed = true;
+        batch.clear();
+    };
+    auto visit = [&](const ImportRecord* record) {
+        Mutation m;
+        if (record == nullptr || !importMutation(*record, m)) {
+            summary.rejected++;
+            return;
+        }
+        if (m.op == "logMood") summary.moods++;
+        else if (m.op == "addThought") summary.thoughts++;
+        else summary.strategies++;
+        batch.push_back(move(m));
+        if (batch.size() >= IMPORT_BATCH_ENTRIES) flush();
+    };
+    
+    char chunk[64 * 1024];
+    size_t n;
+    while (!summary.failed && (n = body.read(chunk, sizeof(chunk))) > 0) {
+        parser.feed(chunk, n, visit);
+    }
+    if (!summary.failed) parser.finish(visit);
+    flush();
+    return summary;
+}
+
+string importReport(const ImportSummary& summary) {
+    return "moods=" + to_string(summary.moods) + "\nthoughts=" + to_string(summary.thoughts) +
+           "\nstrategies=" + to_string(summary.strategies) + "\nrejected=" + to_string(summary.rejected) +
+           "\nbatches=" + to_string(summary.batches) + "\nstatus=" + (summary.failed ? "failed" : "ok") + "\n";
+}
+
+// Buffers output and passes it on in EXPORT_CHUNK_BYTES pieces, framed as
+// HTTP/1.1 chunks in server mode.
+struct ChunkedWriter {
+    int fd;
+    bool chunked;
+    string buffer;
+    bool ok = true;
+    
+    ChunkedWriter(int fd, bool chunked) : fd(fd), chunked(chunked) {
+        buffer.reserve(EXPORT_CHUNK_BYTES + 4096);
+    }
+    
+    void append(string_view data) {
+        buffer.append(data.data(), data.size());
+        if (buffer.size() >= EXPORT_CHUNK_BYTES) flush();
+    }
+    
+    void flush() {
+        if (buffer.empty() || !ok) return;
+        if (chunked) {
+            char size[24];
+            int len = snprintf(size, sizeof(size), "%zx\r\n", buffer.size());
+            buffer += "\r\n";
+            ok = writeResponse(fd, string(size, len), buffer);
+        } else {
+            ok = writeAll(fd, buffer.data(), buffer.size());
+        }
+        buffer.clear();
+    }
+    
+    bool finish() {
+        flush();
+        if (chunked && ok) ok = writeAll(fd, "0\r\n\r\n", 5);
+        return ok;
+    }
+};
+
+void appendCsvField(string& out, string_view field) {
+    if (field.find_first_of(",\"\r\n") == string_view::npos) {
+        out.append(field.data(), field.size());
+        return;
+    }
+    out += '"';
+    for (char c : field) {
+        if (c == '"') out += '"';
+        out += c;
+    }
+    out += '"';
+}
+
+void appendJsonString(string& out, string_view text) {
+    out += '"';
+    for (unsigned char c : text) {
+        if (c == '"' || c == '\\') {
+            out += '\\';
+            out += c;
+        } else if (c == '\n') {
+            out += "\\n";
+        } else if (c == '\r') {
+            out += "\\r";
+        } else if (c == '\t') {
+            out += "\\t";
+        } else if (c < 0x20) {
+            char escaped[8];
+            snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+            out += escaped;
+        } else {
+            out += c;
+        }
+    }
+    out += '"';
+}
+
+void appendExportRecord(string& out, bool jsonl, const char* type, long long when, string_view value, string_view extra) {
+    if (jsonl) {
+        out += "{\"type\":\"";
+        out += type;
+        out += '"';
+        if (when > 0) {
+            out += ",\"time\":";
+            appendNumber(out, when);
+        }
+        out += ",\"value\":";
+        appendJsonString(out, value);
+        if (!extra.empty()) {
+            out += ",\"extra\":";
+            appendJsonString(out, extra);
+        }
+        out += "}\n";
+    } else {
+        out += type;
+        out += ',';
+        if (when > 0) appendNumber(out, when);
+        out += ',';
+        appendCsvField(out, value);
+        out += ',';
+        appendCsvField(out, extra);
+        out += '\n';
+    }
+}
+
+// Streams everything the user has: strategies, then every mood event and
+// journal entry oldest first (archive, then entries waiting for it, then the
+// rings). 'state' may be a private copy; the archive is only appended to.
+bool exportState(const StatePaths& paths, const MentalHealthState& state, bool jsonl, ChunkedWriter& out) {
+    string record;
+    auto emit = [&](const char* type, long long when, string_view value, string_view extra) {
+        record.clear();
+        appendExportRecord(record, jsonl, type, when, value, extra);
+        out.append(record);
+    };
+    if (!jsonl) out.append("type,time,value,extra\n");
+    for (const auto& strategy : state.copingStrategies) {
+        emit("strategy", strategy.uses > 0 ? strategy.lastUsed : 0, strategy.text, strategy.uses > 0 ? to_string(strategy.uses) : "");
+    }
+    
+    unsigned long long lastMood = 0;
+    auto emitMood = [&](unsigned long long id, int64_t when, MoodId mood) {
+        if (id <= lastMood) return;
+        lastMood = id;
+        emit("mood", when, moodName(mood), "");
+    };
+    readArchive(paths, ARCHIVE_MOODS, 1, ULLONG_MAX, [&](const ArchiveSegmentHeader& header, string_view raw) {
+        forEachArchivedMood(header, raw, emitMood);
+    });
+    for (const MoodEvent& event : state.unarchivedMoods) emitMood(event.id, event.time, event.mood);
+    const MoodSeries& series = state.moodHistory;
+    for (size_t i = 0; i < series.size(); i++) {
+        emitMood(series.eventsRecorded - series.size() + 1 + i, series.times[i], series.moods[i]);
+    }
+    
+    unsigned long long lastThought = 0;
+    auto emitThought = [&](unsigned long long id, const string& thought, const string& timestamp) {
+        if (id <= lastThought) return;
+        lastThought = id;
+        emit("thought", 0, thought, timestamp);
+    };
+    readArchive(paths, ARCHIVE_THOUGHTS, 1, ULLONG_MAX, [&](const ArchiveSegmentHeader& header, string_view raw) {
+        forEachArchivedThought(header, raw, emitThought);
+    });
+    for (const JournalEntry& entry : state.unarchivedThoughts) emitThought(entry.id, entry.thought, entry.timestamp);
+    for (size_t i = 0; i < state.thoughtJournal.size(); i++) {
+        emitThought(state.thoughtsRecorded - state.thoughtJournal.size() + 1 + i,
+                    state.thoughtJournal[i].first, state.thoughtJournal[i].second);
+    }
+    return out.finish();
+}
+
+bool wantsJsonl(const RequestParams& params, const string& contentType) {
+    if (!params.format.empty()) return params.format == "jsonl" || params.format == "json";
+    return contentType.find("json") != string::npos;
+}
 
-MentalHealthState loadState() {
-    MentalHealthState state;
-    ifstream file(STATE_FILE);
-    string line;
+string exportHeaders(bool jsonl) {
+    return jsonl ? "Content-Type: application/x-ndjson\r\nContent-Disposition: attachment; filename=\"mental-health-export.jsonl\"\r\n"
+                 : "Content-Type: text/csv; charset=utf-8\r\nContent-Disposition: attachment; filename=\"mental-health-export.csv\"\r\n";
+}
+
+// ---------------------------------------------------------------------------
+// JSON API
+//
+// format=json, or an Accept header that asks for application/json and not
+// HTML, returns the dashboard data as JSON instead of the page. With
+// since=<version> only what changed after that version is sent: mood events
+// and journal entries carry the version that wrote them, and the strategy
+// list is only included if it changed. The small fixed-size parts (current
+// mood, statistics, last strategy) are always included.
+// ---------------------------------------------------------------------------
+
+bool wantsJsonApi(const RequestParams& params, const string& accept) {
+    if (!params.format.empty()) return params.format == "json";
+    return accept.find("application/json") != string::npos && accept.find("text/html") == string::npos;
+}
+
+// Index of the first entry written after 'since'; versions ascend
+size_t firstVersionAfter(const RingBuffer<uint64_t>& versions, unsigned long long since) {
+    size_t lo = 0, hi = versions.size();
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (versions[mid] <= since) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+void appendJsonState(string& out, const MentalHealthState& state, const RequestParams& params, const AppConfig& config) {
+    // A client ahead of us holds a version of some other state; start it over
+    bool delta = params.hasSince && params.since <= state.version;
+    const MoodSeries& series = state.moodHistory;
+    size_t firstMood = delta ? firstVersionAfter(series.versions, params.since) : 0;
+    size_t firstThought = delta ? firstVersionAfter(state.thoughtVersions, params.since) : 0;
+    bool moodsArchived = series.eventsRecorded > series.size();
+    bool thoughtsArchived = state.thoughtsRecorded > state.thoughtJournal.size();
+    // Older entries that are only in the archive (see action=history): all of
+    // them for a full response, or a possible gap before the first delta entry
+    bool truncated;
+    if (delta) {
+        truncated = (firstMood == 0 && moodsArchived && series.versions[0] > params.since + 1) ||
+                    (firstThought == 0 && thoughtsArchived && state.thoughtVersions[0] > params.since + 1);
+    } else {
+        truncated = moodsArchived || thoughtsArchived;
+    }
     
-    if (file.is_open()) {
-        // Read current mood
-        getline(file, line);
-        if (line.find("CURRENT_MOOD:") != string::npos) {
-            state.currentMood = line.substr(line.find(":") + 2);
-        }
-        
-        // Read last strategy used
-        getline(file, line);
-        if (line.find("LAST_STRATEGY:") != string::npos) {
-            state.lastStrategyUsed = line.substr(line.find(":") + 2);
-        }
-        
-        // Read last strategy time
-        getline(file, line);
-        if (line.find("LAST_STRATEGY_TIME:") != string::npos) {
-            state.lastStrategyTime = stol(line.substr(line.find(":") + 2));
-        }
-        
-        // Read mood statistics
-        while (getline(file, line) && line != "MOOD_HISTORY:") {
-            if (line.find("MOOD_STAT:") != string::npos) {
-                size_t colon = line.find(":");
-                size_t dash = line.find("-");
-                if (dash != string::npos) {
-                    string mood = line.substr(colon + 2, dash - colon - 2);
-                    int count = stoi(line.substr(dash + 1));
-                    state.moodStatistics[mood] = count;
-                }
-            }
+    out += "{\"version\":";
+    appendNumber(out, state.version);
+    out += delta ? ",\"delta\":true" : ",\"delta\":false";
+    out += truncated ? ",\"truncated\":true" : ",\"truncated\":false";
+    out += ",\"currentMood\":{\"name\":";
+    appendJsonString(out, moodName(state.currentMood));
+    out += ",\"emoji\":";
+    appendJsonString(out, state.currentMood < MOOD_COUNT ? string_view(config.moodEmojis[state.currentMood])
+                                                         : moodEmoji(state.currentMood));
+    out += "},\"moodStatistics\":{";
+    bool first = true;
+    for (size_t id = 0; id < MOOD_COUNT; id++) {
+        if (state.moodStatistics[id] == 0) continue;
+        if (!first) out += ',';
+        first = false;
+        appendJsonString(out, MOODS[id].name);
+        out += ':';
+        appendNumber(out, state.moodStatistics[id]);
+    }
+    out += "},\"lastStrategy\":{\"text\":";
+    appendJsonString(out, state.lastStrategyUsed);
+    out += ",\"time\":";
+    appendNumber(out, state.lastStrategyTime);
+    out += "},\"moodsRecorded\":";
+    appendNumber(out, series.eventsRecorded);
+    out += ",\"thoughtsRecorded\":";
+    appendNumber(out, state.thoughtsRecorded);
+    
+    out += ",\"moods\":[";
+    unsigned long long firstMoodId = series.eventsRecorded - series.size() + 1;
+    for (size_t i = firstMood; i < series.size(); i++) {
+        if (i > firstMood) out += ',';
+        out += "{\"id\":";
+        appendNumber(out, firstMoodId + i);
+        out += ",\"version\":";
+        appendNumber(out, series.versions[i]);
+        out += ",\"time\":";
+        appendNumber(out, series.times[i]);
+        out += ",\"mood\":";
+        appendJsonString(out, moodName(series.moods[i]));
+        out += '}';
+    }
+    out += "],\"thoughts\":[";
+    unsigned long long firstThoughtId = state.thoughtsRecorded - state.thoughtJournal.size() + 1;
+    for (size_t i = firstThought; i < state.thoughtJournal.size(); i++) {
+        if (i > firstThought) out += ',';
+        out += "{\"id\":";
+        appendNumber(out, firstThoughtId + i);
+        out += ",\"version\":";
+        appendNumber(out, state.thoughtVersions[i]);
+        out += ",\"text\":";
+        appendJsonString(out, state.thoughtJournal[i].first);
+        out += ",\"timestamp\":";
+        appendJsonString(out, state.thoughtJournal[i].second);
+        out += '}';
+    }
+    out += ']';
+    
+    if (!delta || state.strategiesVersion > params.since) {
+        // Current suggestion first, as on the dashboard
+        size_t total = state.copingStrategies.size();
+        out += ",\"strategies\":[";
+        for (size_t i = 0; i < total; i++) {
+            if (i > 0) out += ',';
+            appendJsonString(out, state.copingStrategies[(state.strategyCursor + i) % total].text);
         }
-        
-        // Read mood history
-        while (getline(file, line) && line != "THOUGHT_JOURNAL:") {
-            if (!line.empty()) {
-                state.moodHistory.push_back(line);
+        out += ']';
+    }
+    out += "}\n";
+}
+
+// The population action. Operators get every mood in every window, zeros
+// included, so dashboards can rely on the keys being there:
+//   {"merged_at":...,"windows":{"all_time":{"total":N,"moods":{"Happy":n,...}},"today":...}}
+void appendPopulationWindow(string& out, const char* name, const PopulationCounts& counts) {
+    uint64_t total = 0;
+    for (uint64_t count : counts) total += count;
+    out += '"';
+    out += name;
+    out += "\":{\"total\":";
+    out += to_string(total);
+    out += ",\"moods\":{";
+    for (size_t id = 0; id < MOOD_COUNT; id++) {
+        if (id > 0) out += ',';
+        appendJsonString(out, moodName((MoodId)id));
+        out += ':';
+        out += to_string(counts[id]);
+    }
+    out += "}}";
+}
+
+// Compares in constant time, so response times don't give the token away
+bool adminTokenMatches(const string& given, const string& expected) {
+    if (expected.empty() || given.size() != expected.size()) return false;
+    unsigned char difference = 0;
+    for (size_t i = 0; i < given.size(); i++) difference |= given[i] ^ expected[i];
+    return difference == 0;
+}
+
+// Fills 'body' for action=population and returns the HTTP status
+int populationReport(const AppConfig& config, const RequestParams& params, RequestTimer& timer, string& body) {
+    if (config.adminToken.empty()) {
+        body = "The population view is off. Set ADMIN_TOKEN in " + CONFIG_FILE + " to turn it on.\n";
+        return 403;
+    }
+    if (!adminTokenMatches(params.token, config.adminToken)) {
+        body = "Wrong or missing token.\n";
+        return 403;
+    }
+    timer.enter(PHASE_LOAD);
+    if (populationMergeDue()) mergePopulationMoods(false);
+    AggregateCheckpoint checkpoint;
+    if (!readAggregateCheckpoint(checkpoint)) checkpoint = AggregateCheckpoint();
+    timer.enter(PHASE_RENDER);
+    
+    int32_t today = localDay(time(0));
+    PopulationCounts allTime;
+    copy(begin(checkpoint.allTime), end(checkpoint.allTime), allTime.begin());
+    body = "{\"merged_at\":" + to_string(checkpoint.mergedAt) + ",\"windows\":{";
+    appendPopulationWindow(body, "all_time", allTime);
+    body += ',';
+    appendPopulationWindow(body, "today", checkpointWindow(checkpoint, today, today));
+    body += ',';
+    appendPopulationWindow(body, "this_week", checkpointWindow(checkpoint, weekOfDay(today) * 7 - 3, today));
+    body += ',';
+    appendPopulationWindow(body, "last_7_days", checkpointWindow(checkpoint, today - 6, today));
+    body += ',';
+    appendPopulationWindow(body, "last_30_days", checkpointWindow(checkpoint, today - 29, today));
+    body += "}}\n";
+    timer.enter(-1);
+    return 200;
+}
+
+// ---------------------------------------------------------------------------
+// Conditional GET
+//
+// Each dashboard carries an ETag built from the user's state version. A
+// revalidation whose If-None-Match still matches is answered with 304 after
+// reading just the snapshot header and the last log record.
+// ---------------------------------------------------------------------------
+
+// Sequence number of the last complete record in a log file, 0 if none.
+unsigned long long lastLogSequence(const string& path) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) return 0;
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return 0;
+    }
+    
+    // Walk backwards to the newline ending the last complete record, then to
+    // the one before it; the record's sequence number starts right after.
+    char chunk[4096];
+    off_t end = st.st_size;
+    int newlinesSeen = 0;
+    off_t recordStart = 0;
+    while (end > 0 && newlinesSeen < 2) {
+        off_t start = max((off_t)0, end - (off_t)sizeof(chunk));
+        ssize_t n = pread(fd, chunk, end - start, start);
+        if (n != end - start) break;
+        for (ssize_t i = n - 1; i >= 0; i--) {
+            if (chunk[i] != '\n') continue;
+            if (++newlinesSeen == 2) {
+                recordStart = start + i + 1;
+                break;
             }
         }
-        
-        // Read thought journal
-        while (getline(file, line) && line != "COPING_STRATEGIES:") {
-            if (!line.empty()) {
-                // Check if line contains timestamp
-                size_t sep = line.find("|");
-                if (sep != string::npos) {
-                    string thought = line.substr(0, sep);
-                    string timestamp = line.substr(sep + 1);
-                    state.thoughtJournal.push_back({thought, timestamp});
-                } else {
-                    state.thoughtJournal.push_back({line, ""});
-                }
-            }
+        end = start;
+    }
+    
+    unsigned long long seq = 0;
+    if (newlinesSeen > 0) {
+        char digits[24] = {};
+        if (pread(fd, digits, sizeof(digits) - 1, recordStart) > 0) {
+            seq = strtoull(digits, NULL, 10);
         }
-        
-        // Read coping strategies
-        while (getline(file, line)) {
-            if (!line.empty()) {
-                state.copingStrategies.push_back(line);
-            }
+    }
+    close(fd);
+    return seq;
+}
+
+unsigned long long peekStateVersion(const StatePaths& paths) {
+    unsigned long long version = 0;
+    int fd = open(paths.snapshot.c_str(), O_RDONLY);
+    if (fd >= 0) {
+        SnapshotHeader header;
+        if (pread(fd, &header, sizeof(header), 0) == (ssize_t)sizeof(header) &&
+            memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) == 0) {
+            version = header.version;
         }
-        
-        file.close();
-    } else {
-        // Initialize with default data if no state file exists
-        state.currentMood = "Neutral";
-        state.lastStrategyUsed = "None yet";
-        state.lastStrategyTime = time(0);
-        
-        // Initialize mood statistics
-        state.moodStatistics["Neutral"] = 1;
+        close(fd);
     }
+    version = max(version, lastLogSequence(paths.compactingLog));
+    version = max(version, lastLogSequence(paths.log));
+    return version;
+}
+
+// Weak, because the "x minutes ago" text may drift while the state stands still.
+// The config file's mtime is mixed in so edited moods or emojis show up.
+string pageETag(const string& session, unsigned long long version, const AppConfig& config) {
+    char etag[64];
+    snprintf(etag, sizeof(etag), "W/\"%08x-%llu-%llx\"", hashSessionId(session), version, config.stamp);
+    return etag;
+}
+
+// If-None-Match may hold a list of tags or "*"; tags compare weakly.
+bool etagMatches(const string& ifNoneMatch, const string& etag) {
+    string_view wanted(etag);
+    if (wanted.substr(0, 2) == "W/") wanted.remove_prefix(2);
     
-    return state;
+    size_t pos = 0;
+    while (pos < ifNoneMatch.size()) {
+        size_t end = ifNoneMatch.find(',', pos);
+        if (end == string::npos) end = ifNoneMatch.size();
+        string_view tag(ifNoneMatch.data() + pos, end - pos);
+        while (!tag.empty() && isspace((unsigned char)tag.front())) tag.remove_prefix(1);
+        while (!tag.empty() && isspace((unsigned char)tag.back())) tag.remove_suffix(1);
+        if (tag == "*") return true;
+        if (tag.substr(0, 2) == "W/") tag.remove_prefix(2);
+        if (tag == wanted) return true;
+        pos = end + 1;
+    }
+    return false;
 }
 
-AppConfig loadConfig() {
-    AppConfig config;
+string cacheHeaders(const string& etag) {
+    return "ETag: " + etag + "\r\nCache-Control: no-cache\r\nVary: Cookie, Accept\r\n";
+}
+
+// ---------------------------------------------------------------------------
+// Server mode
+//
+// "hello.cgi --serve [port] [threads]" keeps the config and state in memory
+// and answers plain HTTP on 127.0.0.1, so Apache (or anything else) can proxy
+// to it instead of spawning one process per page view.
+// ---------------------------------------------------------------------------
+
+struct HttpRequest {
+    string method;
+    string path;
+    string query;
+    map<string, string> headers; // lower-case names
+    string body;
+    size_t unreadBodyBytes = 0; // a body too large to buffer; only an import reads it
+    bool keepAlive = false;
+};
+
+// Users are striped over STATE_SHARDS by session hash. A shard's mutex
+// serializes writes for the users in it and guards its slice of the hot
+// state LRU, so a user's state is never loaded twice and unrelated users
+// rarely contend. The server assumes it owns DATA_DIR (no flock()).
+//
+// Reads don't take that mutex while the user is unchanged. Page views
+// render an immutable copy of the state (read-copy-update); a change only
+// drops that copy, and the first reader after it takes the mutex once to
+// make the next one. Writers render from the cached state itself, so a
+// burst of changes copies nothing and a large state is copied at most once
+// per version that is actually read. publishMutex only guards swapping the
+// pointers, so a reader holding a copy never waits for a writer.
+const size_t STATE_SHARDS = 64;
+
+struct HotState {
+    string session;
+    MentalHealthState state;
+    uint64_t configGeneration; // config the state was last prepared with
+};
+
+struct PublishedState {
+    shared_ptr<const MentalHealthState> state;
+    uint64_t configGeneration = 0;
+};
+
+struct StateShard {
+    mutex m;
+    mutex snapshotMutex; // one snapshot writer per shard: the compactor or an import
+    list<HotState> lru;  // most recently used first
+    unordered_map<string, list<HotState>::iterator> index;
+    mutex publishMutex;  // taken after m, never before it
+    unordered_map<string, PublishedState> published; // at most one per user in the LRU
     
-    // Default configuration
-    config.availableMoods = {"Happy", "Sad", "Anxious", "Angry", "Tired", "Stressed", "Neutral", "Excited", "Calm"};
-    config.moodEmojis = {
-        {"Happy", "😊"},
-        {"Sad", "😢"},
-        {"Anxious", "😰"},
-        {"Angry", "😠"},
-        {"Tired", "😴"},
-        {"Stressed", "😫"},
-        {"Neutral", "😐"},
-        {"Excited", "😃"},
-        {"Calm", "😌"}
-    };
-    config.defaultStrategies = {
-        "Deep breathing for 5 minutes",
-        "Take a short walk outside",
-        "Write down three things you're grateful for",
-        "Listen to calming music",
-        "Practice mindfulness meditation",
-        "Drink a glass of water",
-        "Stretch your body",
-        "Read a book for 15 minutes",
-        "Call a friend or family member"
-    };
-    config.maxHistoryItems = 50;
-    config.enableTimestamps = true;
+    // The copy readers see, or NULL if the user isn't cached under this
+    // config or changed since it was made
+    shared_ptr<const MentalHealthState> current(const string& session, const AppConfig& config) {
+        lock_guard<mutex> lock(publishMutex);
+        auto it = published.find(session);
+        if (it == published.end() || it->second.configGeneration != config.generation) return nullptr;
+        return it->second.state;
+    }
     
-    // Try to load configuration from file
-    ifstream file(CONFIG_FILE);
-    string line;
+    // Caller must hold m. Copies the cached state for readers.
+    shared_ptr<const MentalHealthState> publish(const HotState& hot) {
+        PublishedState next = {make_shared<const MentalHealthState>(hot.state), hot.configGeneration};
+        shared_ptr<const MentalHealthState> state = next.state;
+        lock_guard<mutex> lock(publishMutex);
+        // The old copy is freed by whoever drops the last reference; if that
+        // is us, 'next' carries it out of the lock
+        swap(published[hot.session], next);
+        return state;
+    }
+    
+    // Caller must hold m. Call after every change to the cached state.
+    void unpublish(const string& session) {
+        PublishedState old;
+        lock_guard<mutex> lock(publishMutex);
+        auto it = published.find(session);
+        if (it == published.end()) return;
+        swap(it->second, old);
+        published.erase(it);
+    }
+    
+    // Caller must hold m. Returns NULL if the user is not in memory.
+    MentalHealthState* find(const string& session) {
+        auto it = index.find(session);
+        return it == index.end() ? NULL : &it->second->state;
+    }
     
-    if (file.is_open()) {
-        while (getline(file, line)) {
-            if (line.find("MAX_HISTORY:") != string::npos) {
-                config.maxHistoryItems = stoi(line.substr(line.find(":") + 1));
-            } else if (line.find("TIMESTAMPS:") != string::npos) {
-                config.enableTimestamps = (line.substr(line.find(":") + 1) == "1");
+    // Caller must hold m. A state cached under an older config is resized
+    // to the new one first. NULL if the user's snapshot cannot be read.
+    MentalHealthState* acquire(const string& session, const AppConfig& config) {
+        auto it = index.find(session);
+        if (it != index.end()) {
+            lru.splice(lru.begin(), lru, it->second);
+            HotState& hot = lru.front();
+            if (hot.configGeneration != config.generation) {
+                prepareState(hot.state, config);
+                hot.configGeneration = config.generation;
+                unpublish(session);
             }
+            return &hot.state;
+        }
+        MentalHealthState state;
+        if (!restoreState(statePathsIn(userStateDir(session)), config, state)) return NULL;
+        lru.push_front({session, move(state), config.generation});
+        index[session] = lru.begin();
+        if (lru.size() > HOT_STATE_CAPACITY / STATE_SHARDS) {
+            unpublish(lru.back().session);
+            index.erase(lru.back().session);
+            lru.pop_back();
         }
-        file.close();
+        return &lru.front().state;
     }
     
-    return config;
+    // The current copy, loading the user or copying their latest changes
+    // first if needed. NULL if the user's snapshot cannot be read.
+    shared_ptr<const MentalHealthState> read(const string& session, const AppConfig& config) {
+        shared_ptr<const MentalHealthState> state = current(session, config);
+        if (state != nullptr) return state;
+        lock_guard<mutex> lock(m);
+        return readLocked(session, config);
+    }
+    
+    // Caller must hold m. Same as read().
+    shared_ptr<const MentalHealthState> readLocked(const string& session, const AppConfig& config) {
+        if (acquire(session, config) == NULL) return nullptr;
+        shared_ptr<const MentalHealthState> state = current(session, config);
+        // Another reader may have made the copy while we waited for m
+        return state != nullptr ? state : publish(lru.front());
+    }
+    
+    // Caller must hold m. Forgets the cached copy so the next request reloads it.
+    void drop(const string& session) {
+        auto it = index.find(session);
+        if (it == index.end()) return;
+        unpublish(session);
+        lru.erase(it->second);
+        index.erase(it);
+    }
+};
+
+struct ServerContext {
+    StateShard shards[STATE_SHARDS];
+    
+    StateShard& shardFor(const string& session) {
+        return shards[hashSessionId(session) % STATE_SHARDS];
+    }
+    
+    GroupCommit commits;
+    
+    // Log compaction runs on its own thread so no request waits for it
+    mutex compactMutex;
+    condition_variable compactCv;
+    condition_variable compactIdle; // the queue is empty and nothing is being compacted
+    deque<string> compactQueue;
+    unordered_set<string> compactQueued;
+    bool compacting = false;
+};
+
+void requestCompaction(ServerContext& ctx, const string& session) {
+    {
+        lock_guard<mutex> lock(ctx.compactMutex);
+        if (!ctx.compactQueued.insert(session).second) return;
+        ctx.compactQueue.push_back(session);
+    }
+    ctx.compactCv.notify_one();
 }
 
-void saveState(const MentalHealthState& state, const AppConfig& config) {
-    ofstream file(STATE_FILE);
-    if (file.is_open()) {
-        file << "CURRENT_MOOD: " << state.currentMood << "\n";
-        file << "LAST_STRATEGY: " << state.lastStrategyUsed << "\n";
-        file << "LAST_STRATEGY_TIME: " << state.lastStrategyTime << "\n";
-        
-        // Save mood statistics
-        for (const auto& stat : state.moodStatistics) {
-            file << "MOOD_STAT: " << stat.first << "-" << stat.second << "\n";
+void runCompactor(ServerContext& ctx) {
+    while (true) {
+        string session;
+        {
+            unique_lock<mutex> lock(ctx.compactMutex);
+            ctx.compacting = false;
+            if (ctx.compactQueue.empty()) ctx.compactIdle.notify_all();
+            ctx.compactCv.wait(lock, [&ctx] { return !ctx.compactQueue.empty(); });
+            session = ctx.compactQueue.front();
+            ctx.compactQueue.pop_front();
+            ctx.compactQueued.erase(session);
+            ctx.compacting = true;
         }
-        
-        file << "MOOD_HISTORY:\n";
-        int startIdx = max(0, static_cast<int>(state.moodHistory.size()) - config.maxHistoryItems);
-        for (size_t i = startIdx; i < state.moodHistory.size(); i++) {
-            file << state.moodHistory[i] << "\n";
+        StatePaths paths = statePathsIn(userStateDir(session));
+        MentalHealthState snapshot;
+        RequestTimer timer;
+        {
+            StateShard& shard = ctx.shardFor(session);
+            lock_guard<mutex> lock(shard.m);
+            if (!logNeedsCompaction(paths)) continue;
+            MentalHealthState* state = shard.acquire(session, *currentConfig());
+            if (state == NULL) continue;
+            snapshot = *state;
+            beginCompaction(paths);
         }
-        
-        file << "THOUGHT_JOURNAL:\n";
-        startIdx = max(0, static_cast<int>(state.thoughtJournal.size()) - config.maxHistoryItems);
-        for (size_t i = startIdx; i < state.thoughtJournal.size(); i++) {
-            file << state.thoughtJournal[i].first << "|" << state.thoughtJournal[i].second << "\n";
+        timer.enter(PHASE_SAVE);
+        bool compacted;
+        {
+            lock_guard<mutex> lock(ctx.shardFor(session).snapshotMutex);
+            compacted = finishCompaction(paths, snapshot);
         }
-        
-        file << "COPING_STRATEGIES:\n";
-        for (const auto& strategy : state.copingStrategies) {
-            file << strategy << "\n";
+        timer.enter(-1);
+        recordRequestMetrics(metricActionIndex("compaction"), timer);
+        if (compacted) {
+            // Those thoughts are searchable from the index file now
+            StateShard& shard = ctx.shardFor(session);
+            lock_guard<mutex> lock(shard.m);
+            MentalHealthState* cached = shard.find(session);
+            if (cached != NULL) {
+                auto& pending = cached->unindexedThoughts;
+                pending.erase(remove_if(pending.begin(), pending.end(),
+                                        [&snapshot](const pair<unsigned long long, string>& thought) {
+                                            return thought.first <= snapshot.thoughtsRecorded;
+                                        }),
+                              pending.end());
+                // Everything older than the snapshot's rings is in the archive now
+                unsigned long long moodsArchived = snapshot.moodHistory.eventsRecorded - snapshot.moodHistory.size();
+                unsigned long long thoughtsArchived = snapshot.thoughtsRecorded - snapshot.thoughtJournal.size();
+                auto& moods = cached->unarchivedMoods;
+                moods.erase(remove_if(moods.begin(), moods.end(),
+                                      [moodsArchived](const MoodEvent& event) { return event.id <= moodsArchived; }),
+                            moods.end());
+                auto& thoughts = cached->unarchivedThoughts;
+                thoughts.erase(remove_if(thoughts.begin(), thoughts.end(),
+                                         [thoughtsArchived](const JournalEntry& entry) { return entry.id <= thoughtsArchived; }),
+                               thoughts.end());
+                shard.unpublish(session);
+            }
         }
-        
-        file.close();
     }
 }
 
-string getTimestamp() {
-    time_t now = time(0);
-    tm* ltm = localtime(&now);
-    char buffer[20];
-    strftime(buffer, sizeof(buffer), "%Y-%m-%d %H:%M", ltm);
-    return string(buffer);
+// Blocks until every requested compaction has finished writing
+void waitForCompactions(ServerContext& ctx) {
+    unique_lock<mutex> lock(ctx.compactMutex);
+    ctx.compactIdle.wait(lock, [&ctx] { return ctx.compactQueue.empty() && !ctx.compacting; });
 }
 
-string formatTimeAgo(time_t pastTime) {
-    time_t now = time(0);
-    double seconds = difftime(now, pastTime);
+struct ConnectionQueue {
+    mutex m;
+    condition_variable cv;
+    queue<int> fds;
     
-    if (seconds < 60) return "just now";
-    if (seconds < 3600) return to_string(static_cast<int>(seconds/60)) + " minutes ago";
-    if (seconds < 86400) return to_string(static_cast<int>(seconds/3600)) + " hours ago";
-    return to_string(static_cast<int>(seconds/86400)) + " days ago";
-}
-
-void printPage(const MentalHealthState& state, const AppConfig& config) {
-    cout << "Content-type: text/html\r\n\r\n";
-    cout << "<!DOCTYPE html>\n";
-    cout << "<html lang='en'>\n";
-    cout << "<head>\n";
-    cout << "<meta charset='UTF-8'>\n";
-    cout << "<meta name='viewport' content='width=device-width, initial-scale=1.0'>\n";
-    cout << "<title>Enhanced Mental Health Tracker</title>\n";
-    
-    // Chat widget (internet चाहिए)
-    cout << "<script src='https://cdn.jotfor.ms/agent/embedjs/0198cbf6508f730a8d1f0df6d65ae0f3d772/embed.js'></script>\n";
-    
-    cout << "<style>\n";
-    cout << "        * { box-sizing: border-box; margin: 0; padding: 0; font-family: 'Segoe UI', Tahoma, Geneva, Verdana, sans-serif; }\n";
-    cout << "        body { background: linear-gradient(135deg, #1a2a6c, #b21f1f, #fdbb2d); padding: 20px; color: #333; min-height: 100vh; }\n";
-    cout << "        .header { text-align: center; margin-bottom: 30px; color: white; text-shadow: 0 2px 4px rgba(0,0,0,0.3); }\n";
-    cout << "        .header h1 { margin-bottom: 10px; font-size: 2.5em; }\n";
-    cout << "        .header p { font-size: 1.2em; opacity: 0.9; }\n";
-    cout << "        .container { display: grid; grid-template-columns: repeat(auto-fit, minmax(350px, 1fr)); gap: 25px; max-width: 1400px; margin: 0 auto; }\n";
-    cout << "        .panel { background: rgba(255, 255, 255, 0.95); border-radius: 15px; box-shadow: 0 8px 30px rgba(0,0,0,0.15); overflow: hidden; transition: transform 0.3s ease, box-shadow 0.3s ease; }\n";
-    cout << "        .panel:hover { transform: translateY(-5px); box-shadow: 0 12px 40px rgba(0,0,0,0.2); }\n";
-    cout << "        .panel-header { padding: 20px; color: white; font-weight: bold; font-size: 1.3em; display: flex; align-items: center; gap: 12px; }\n";
-    cout << "        .panel-header.mood { background: linear-gradient(to right, #ff7e5f, #feb47b); }\n";
-    cout << "        .panel-header.thoughts { background: linear-gradient(to right, #00cdac, #02aab0); }\n";
-    cout << "        .panel-header.strategies { background: linear-gradient(to right, #7474bf, #348ac7); }\n";
-    cout << "        .panel-header.stats { background: linear-gradient(to right, #8e2de2, #4a00e0); }\n";
-    cout << "        .panel-content { padding: 25px; }\n";
-    cout << "        .current-value { margin: 15px 0; padding: 18px; background: #f8f9fa; border-radius: 10px; border-left: 5px solid #3498db; font-size: 1.1em; }\n";
-    cout << "        .visualization { border: 1px solid #e0e0e0; border-radius: 10px; padding: 15px; margin: 15px 0; min-height: 200px; max-height: 300px; overflow-y: auto; background: #fafafa; }\n";
-    cout << "        .mood-item, .thought-item, .strategy-item { padding: 12px; border-radius: 8px; margin-bottom: 10px; display: flex; justify-content: space-between; align-items: center; }\n";
-    cout << "        .mood-item { background: linear-gradient(to right, #fff5f5, #ffecec); border-left: 4px solid #ff7e5f; }\n";
-    cout << "        .thought-item { background: linear-gradient(to right, #f0fdfa, #e6fcf7); border-left: 4px solid #00cdac; }\n";
-    cout << "        .strategy-item { background: linear-gradient(to right, #f0f4ff, #e6edff); border-left: 4px solid #7474bf; }\n";
-    cout << "        .empty-message { color: #7f8c8d; text-align: center; padding: 30px; font-style: italic; }\n";
-    cout << "        form { margin-top: 20px; }\n";
-    cout << "        select, input[type='text'], textarea { width: 100%; padding: 14px; margin-bottom: 15px; border: 1px solid #ddd; border-radius: 8px; font-size: 1em; }\n";
-    cout << "        textarea { min-height: 100px; resize: vertical; }\n";
-    cout << "        button { padding: 14px 20px; border: none; border-radius: 8px; color: white; cursor: pointer; font-weight: bold; margin-right: 10px; margin-bottom: 10px; transition: all 0.2s ease; }\n";
-    cout << "        .btn-primary { background: #3498db; }\n";
-    cout << "        .btn-primary:hover { background: #2980b9; transform: scale(1.05); }\n";
-    cout << "        .btn-warning { background: #e67e22; }\n";
-    cout << "        .btn-warning:hover { background: #d35400; transform: scale(1.05); }\n";
-    cout << "        .btn-success { background: #2ecc71; }\n";
-    cout << "        .btn-success:hover { background: #27ae60; transform: scale(1.05); }\n";
-    cout << "        .btn-info { background: #9b59b6; }\n";
-    cout << "        .btn-info:hover { background: #8e44ad; transform: scale(1.05); }\n";
-    cout << "        .mood-emoji { font-size: 1.8em; }\n";
-    cout << "        .timestamp { font-size: 0.85em; color: #7f8c8d; }\n";
-    cout << "        .stats-grid { display: grid; grid-template-columns: repeat(auto-fit, minmax(120px, 1fr)); gap: 15px; margin: 15px 0; }\n";
-    cout << "        .stat-item { background: #f8f9fa; padding: 15px; border-radius: 8px; text-align: center; border: 1px solid #e0e0e0; }\n";
-    cout << "        .stat-value { font-size: 1.8em; font-weight: bold; color: #2c3e50; }\n";
-    cout << "        .stat-label { font-size: 0.9em; color: #7f8c8d; }\n";
-    cout << "        .progress-bar { height: 10px; background: #ecf0f1; border-radius: 5px; overflow: hidden; margin-top: 5px; }\n";
-    cout << "        .progress-fill { height: 100%; background: linear-gradient(to right, #3498db, #2ecc71); }\n";
-    cout << "        .chat-widget-container { position: fixed; top: 20px; right: 20px; z-index: 1000; }\n";
-    cout << "        .chat-toggle-btn { padding: 12px 20px; background: linear-gradient(to right, #3498db, #2ecc71); color: white; border: none; border-radius: 8px; font-weight: bold; cursor: pointer; box-shadow: 0 4px 8px rgba(0,0,0,0.2); transition: all 0.3s ease; }\n";
-    cout << "        .chat-toggle-btn:hover { transform: scale(1.05); box-shadow: 0 6px 12px rgba(0,0,0,0.3); }\n";
-    cout << "        @media (max-width: 768px) { .container { grid-template-columns: 1fr; } .chat-widget-container { top: 10px; right: 10px; } .chat-toggle-btn { padding: 10px 15px; font-size: 0.9em; } }\n";
-    cout << "</style>\n";
-    cout << "</head>\n";
-    cout << "<body>\n";
-    
-    // Chat widget button
-    cout << "<div class='chat-widget-container'>\n";
-    cout << "<button class='chat-toggle-btn' onclick=\"window.JFAgent && window.JFAgent.open(); return false;\">💬 Chat with AI Counselor</button>\n";
-    cout << "</div>\n";
-    
-    cout << "<div class='header'>\n";
-    cout << "<h1>🌱 Enhanced Mental Health Tracker</h1>\n";
-    cout << "<p>Comprehensive mood tracking, thought journaling, and coping strategies</p>\n";
-    cout << "</div>\n";
-    cout << "<div class='container'>\n";
+    void push(int fd) {
+        {
+            lock_guard<mutex> lock(m);
+            fds.push(fd);
+        }
+        cv.notify_one();
+    }
     
-    // Mood Tracker Panel
-    cout << "<div class='panel'>\n";
-    cout << "<div class='panel-header mood'><span>📊</span> Mood Tracker</div>\n";
-    cout << "<div class='panel-content'>\n";
-    cout << "<div class='current-value'>\n";
-    cout << "<strong>Current mood:</strong> " << state.currentMood << " " << config.moodEmojis.at(state.currentMood) << "\n";
-    cout << "</div>\n";
+    int pop() {
+        unique_lock<mutex> lock(m);
+        cv.wait(lock, [this] { return !fds.empty(); });
+        int fd = fds.front();
+        fds.pop();
+        return fd;
+    }
+};
+
+// Reads one request from the connection. Bytes belonging to a pipelined
+// follow-up request stay in 'buffer' for the next call.
+bool readHttpRequest(int fd, string& buffer, HttpRequest& req) {
+    const size_t maxHeaderBytes = 64 * 1024;
+    char chunk[8192];
     
-    // Mood History Visualization
-    cout << "<div class='visualization'>\n";
-    if (state.moodHistory.empty()) {
-        cout << "<div class='empty-message'>No mood history yet. Start tracking your moods!</div>\n";
-    } else {
-        int startIdx = max(0, static_cast<int>(state.moodHistory.size()) - 10);
-        for (int i = (int)state.moodHistory.size() - 1; i >= startIdx; i--) {
-            string mood = state.moodHistory[i];
-            cout << "<div class='mood-item'>" 
-                 << "<span>" << mood << " " << config.moodEmojis.at(mood) << "</span>"
-                 << "<span class='timestamp'>Recorded</span>"
-                 << "</div>\n";
-        }
+    size_t headerEnd;
+    while ((headerEnd = buffer.find("\r\n\r\n")) == string::npos) {
+        if (buffer.size() > maxHeaderBytes) return false;
+        ssize_t n = read(fd, chunk, sizeof(chunk));
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        buffer.append(chunk, n);
     }
-    cout << "</div>\n";
     
-    // Mood Form
-    cout << "<form method='GET'>\n";
-    cout << "<select name='moodInput'>\n";
-    cout << "<option value=''>Select a mood</option>\n";
-    for (const auto& mood : config.availableMoods) {
-        cout << "<option value='" << mood << "'>" << mood << " " << config.moodEmojis.at(mood) << "</option>\n";
-    }
-    cout << "</select>\n";
-    cout << "<button type='submit' name='action' value='logMood' class='btn-primary'>Log Mood</button>\n";
-    cout << "</form>\n";
-    cout << "</div>\n";
-    cout << "</div>\n";
+    // Request line: METHOD TARGET VERSION
+    size_t lineEnd = buffer.find("\r\n");
+    string requestLine = buffer.substr(0, lineEnd);
+    size_t sp1 = requestLine.find(' ');
+    size_t sp2 = requestLine.rfind(' ');
+    if (sp1 == string::npos || sp2 == sp1) return false;
+    req.method = requestLine.substr(0, sp1);
+    string target = requestLine.substr(sp1 + 1, sp2 - sp1 - 1);
+    string version = requestLine.substr(sp2 + 1);
+    size_t qPos = target.find('?');
+    req.path = target.substr(0, qPos);
+    req.query = qPos == string::npos ? "" : target.substr(qPos + 1);
     
-    // Thought Journal Panel
-    cout << "<div class='panel'>\n";
-    cout << "<div class='panel-header thoughts'><span>📝</span> Thought Journal</div>\n";
-    cout << "<div class='panel-content'>\n";
-    cout << "<div class='current-value'>\n";
-    cout << "<strong>Recent thoughts:</strong> " << (state.thoughtJournal.empty() ? "No thoughts recorded yet" : "") << "\n";
-    cout << "</div>\n";
+    // Headers
+    size_t pos = lineEnd + 2;
+    while (pos < headerEnd) {
+        size_t eol = buffer.find("\r\n", pos);
+        string line = buffer.substr(pos, eol - pos);
+        pos = eol + 2;
+        size_t colon = line.find(':');
+        if (colon == string::npos) continue;
+        string name = line.substr(0, colon);
+        transform(name.begin(), name.end(), name.begin(), ::tolower);
+        size_t valueStart = line.find_first_not_of(" \t", colon + 1);
+        req.headers[name] = valueStart == string::npos ? "" : line.substr(valueStart);
+    }
     
-    // Thought Journal Visualization
-    cout << "<div class='visualization'>\n";
-    if (state.thoughtJournal.empty()) {
-        cout << "<div class='empty-message'>Your thoughts will appear here. Journaling helps process emotions.</div>\n";
-    } else {
-        int startIdx = max(0, static_cast<int>(state.thoughtJournal.size()) - 5);
-        for (int i = (int)state.thoughtJournal.size() - 1; i >= startIdx; i--) {
-            cout << "<div class='thought-item'>" 
-                 << "<div>" << state.thoughtJournal[i].first << "</div>"
-                 << "<div class='timestamp'>" << state.thoughtJournal[i].second << "</div>"
-                 << "</div>\n";
-        }
-    }
-    cout << "</div>\n";
-    
-    // Thought Journal Form
-    cout << "<form method='GET'>\n";
-    cout << "<textarea name='thoughtInput' placeholder='What&apos;s on your mind? Writing can help process emotions...'></textarea>\n";
-    cout << "<button type='submit' name='action' value='addThought' class='btn-success'>Journal Thought</button>\n";
-    cout << "</form>\n";
-    cout << "</div>\n";
-    cout << "</div>\n";
-    
-    // Coping Strategies Panel
-    cout << "<div class='panel'>\n";
-    cout << "<div class='panel-header strategies'><span>🛠️</span> Coping Strategies</div>\n";
-    cout << "<div class='panel-content'>\n";
-    cout << "<div class='current-value'>\n";
-    cout << "<strong>Last strategy used:</strong> " << state.lastStrategyUsed << "\n";
-    if (state.lastStrategyTime > 0) {
-        cout << "<div class='timestamp'>" << formatTimeAgo(state.lastStrategyTime) << "</div>\n";
+    string connection = req.headers.count("connection") ? req.headers["connection"] : "";
+    transform(connection.begin(), connection.end(), connection.begin(), ::tolower);
+    req.keepAlive = (version == "HTTP/1.1") ? connection != "close" : connection == "keep-alive";
+    
+    // Body. One too large to buffer stays on the socket: req.body holds what
+    // has already arrived and the handler streams or refuses the rest.
+    size_t contentLength = 0;
+    if (req.headers.count("content-length")) {
+        contentLength = strtoul(req.headers["content-length"].c_str(), NULL, 10);
+    }
+    buffer.erase(0, headerEnd + 4);
+    if (contentLength > MAX_FORM_BODY_BYTES) {
+        req.body = buffer.substr(0, contentLength);
+        buffer.erase(0, req.body.size());
+        req.unreadBodyBytes = contentLength - req.body.size();
+        return true;
+    }
+    while (buffer.size() < contentLength) {
+        ssize_t n = read(fd, chunk, sizeof(chunk));
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        buffer.append(chunk, n);
+    }
+    req.body = buffer.substr(0, contentLength);
+    buffer.erase(0, contentLength);
+    return true;
+}
+
+bool sendHttpResponse(int fd, int status, const string& contentType, const string& extraHeaders,
+                      string_view body, bool keepAlive) {
+    const char* reason = status == 200 ? "OK" : status == 304 ? "Not Modified" : status == 404 ? "Not Found" :
+                         status == 403 ? "Forbidden" : status == 405 ? "Method Not Allowed" : status == 413 ? "Payload Too Large" : status == 500 ? "Internal Server Error" : "Bad Request";
+    string head = "HTTP/1.1 " + to_string(status) + " " + reason + "\r\n";
+    if (status != 304) head += "Content-Type: " + contentType + "\r\n";
+    head += extraHeaders;
+    if (status != 304) head += "Content-Length: " + to_string(body.size()) + "\r\n";
+    head += keepAlive ? "Connection: keep-alive\r\n\r\n" : "Connection: close\r\n\r\n";
+    return writeResponse(fd, head, body);
+}
+
+// The server-wide metrics plus, for a known session, its state gauges
+bool serveMetrics(ServerContext& ctx, int fd, HttpRequest& req, const AppConfig& config, RequestTimer& timer) {
+    string body;
+    appendServerMetrics(body);
+    string session = sessionFromCookies(req.headers["cookie"]);
+    StatePaths paths = statePathsIn(userStateDir(session));
+    if (!session.empty() && access(paths.dir.c_str(), F_OK) == 0) {
+        timer.enter(PHASE_LOAD);
+        shared_ptr<const MentalHealthState> state = ctx.shardFor(session).read(session, config);
+        if (state != nullptr) appendStateMetrics(body, paths, *state);
+        timer.enter(-1);
+    }
+    string headers = timer.serverTimingHeader() + "Cache-Control: no-store\r\n";
+    bool ok = sendHttpResponse(fd, 200, "text/plain; version=0.0.4", headers, body, req.keepAlive);
+    recordRequestMetrics(metricActionIndex("metrics"), timer);
+    return ok;
+}
+
+bool servePopulation(int fd, HttpRequest& req, const AppConfig& config, const RequestParams& params, RequestTimer& timer) {
+    string body;
+    int status = populationReport(config, params, timer, body);
+    string headers = timer.serverTimingHeader() + "Cache-Control: no-store\r\n";
+    bool ok = sendHttpResponse(fd, status, status == 200 ? "application/json" : "text/plain", headers, body, req.keepAlive);
+    recordRequestMetrics(metricActionIndex("population"), timer);
+    return ok;
+}
+
+// Streams the body into the user's state batch by batch. The body is read
+// and parsed without the shard lock; it is only taken to apply and commit a
+// full batch, so a slow upload can't hold up the other users of the shard.
+// Readers may see an import partway through, one committed batch at a time.
+bool serveImport(ServerContext& ctx, int fd, HttpRequest& req, const AppConfig& config, const RequestParams& params, RequestTimer& timer) {
+    string session = sessionFromCookies(req.headers["cookie"]);
+    string extraHeaders;
+    if (session.empty()) {
+        session = newSessionId();
+        extraHeaders = sessionCookieHeader(session);
+    }
+    StatePaths paths = statePathsIn(userStateDir(session));
+    BodySource body;
+    body.fd = fd;
+    body.buffered = req.body;
+    body.remaining = req.body.size() + req.unreadBodyBytes;
+    ImportSummary summary;
+    StateShard& shard = ctx.shardFor(session);
+    // Fail before reading anything if the user's snapshot is unreadable
+    timer.enter(PHASE_LOAD);
+    {
+        lock_guard<mutex> lock(shard.m);
+        summary.failed = shard.acquire(session, config) == NULL;
+    }
+    timer.enter(PHASE_ACTION);
+    if (!summary.failed) {
+        summary = importRecords(body, wantsJsonl(params, req.headers["content-type"]), [&](const vector<Mutation>& batch) {
+            timer.enter(PHASE_SAVE);
+            lock_guard<mutex> lock(shard.m);
+            ensureUserStateDir(session);
+            MentalHealthState* state = shard.acquire(session, config);
+            bool ok = false;
+            if (state != NULL) {
+                lock_guard<mutex> snapshotLock(shard.snapshotMutex);
+                ok = commitImportBatch(*state, paths, batch);
+            }
+            // The cached state may hold a batch that never reached the disk
+            if (ok) shard.unpublish(session);
+            else shard.drop(session);
+            timer.enter(PHASE_ACTION);
+            return ok;
+        });
+    }
+    timer.enter(-1);
+    // Whatever is left of a failed import is still in flight
+    if (body.remaining > 0) req.keepAlive = false;
+    extraHeaders += timer.serverTimingHeader() + "Cache-Control: no-store\r\n";
+    bool ok = sendHttpResponse(fd, summary.failed ? 500 : 200, "text/plain", extraHeaders, importReport(summary),
+                               req.keepAlive);
+    recordRequestMetrics(metricActionIndex("import"), timer);
+    return ok;
+}
+
+// Streams the archive and the published copy of the in-memory part as
+// chunks, without holding the shard lock.
+bool serveExport(ServerContext& ctx, int fd, HttpRequest& req, const AppConfig& config, const RequestParams& params, RequestTimer& timer) {
+    string session = sessionFromCookies(req.headers["cookie"]);
+    StatePaths paths = statePathsIn(userStateDir(session));
+    shared_ptr<const MentalHealthState> state = make_shared<const MentalHealthState>();
+    if (!session.empty() && access(paths.dir.c_str(), F_OK) == 0) {
+        timer.enter(PHASE_LOAD);
+        state = ctx.shardFor(session).read(session, config);
+        timer.enter(-1);
+        if (state == nullptr) {
+            return sendHttpResponse(fd, 500, "text/plain", timer.serverTimingHeader(), STATE_UNREADABLE_MESSAGE,
+                                    req.keepAlive);
+        }
     }
-    cout << "</div>\n";
+    bool jsonl = wantsJsonl(params, "");
+    string head = "HTTP/1.1 200 OK\r\n" + exportHeaders(jsonl) + timer.serverTimingHeader() +
+                  "Cache-Control: no-store\r\nTransfer-Encoding: chunked\r\n";
+    head += req.keepAlive ? "Connection: keep-alive\r\n\r\n" : "Connection: close\r\n\r\n";
+    if (!writeAll(fd, head.data(), head.size())) return false;
+    timer.enter(PHASE_RENDER);
+    ChunkedWriter out(fd, true);
+    bool ok = exportState(paths, *state, jsonl, out);
+    timer.enter(-1);
+    recordRequestMetrics(metricActionIndex("export"), timer);
+    return ok;
+}
+
+bool servePage(ServerContext& ctx, int fd, HttpRequest& req, const AppConfig& config, const RequestParams& params, RequestTimer& timer) {
+    string session = sessionFromCookies(req.headers["cookie"]);
+    bool mutating = isMutatingAction(params.action);
+    // A visitor who only reads is shown the defaults and gets no session,
+    // and no hot state slot, until their first write
+    bool anonymous = session.empty() && !mutating && !hasLegacyState();
+    string extraHeaders;
+    if (session.empty()) {
+        session = newSessionId();
+        if (!anonymous) extraHeaders = sessionCookieHeader(session);
+    }
+    StatePaths paths = statePathsIn(userStateDir(session));
+    bool json = wantsJsonApi(params, req.headers["accept"]);
+    bool revalidate = !json && req.method == "GET" && params.action.empty() && req.headers.count("if-none-match");
     
-    // Strategies Visualization
-    cout << "<div class='visualization'>\n";
-    if (state.copingStrategies.empty()) {
-        cout << "<div class='empty-message'>No strategies available. Add some below!</div>\n";
-    } else {
-        // Show up to 5 strategies
-        int count = 0;
-        for (const auto& strategy : state.copingStrategies) {
-            if (count++ >= 5) break;
-            cout << "<div class='strategy-item'>" << strategy << "</div>\n";
-        }
-    }
-    cout << "</div>\n";
-    
-    // Strategies Form
-    cout << "<form method='GET'>\n";
-    cout << "<button type='submit' name='action' value='suggestStrategy' class='btn-warning'>Suggest a Strategy</button>\n";
-    cout << "<button type='submit' name='action' value='useStrategy' class='btn-success'>Use This Strategy</button>\n";
-    cout << "<button type='submit' name='action' value='addStrategy' class='btn-info'>Add New Strategy</button>\n";
-    cout << "</form>\n";
-    cout << "<form method='GET' style='margin-top: 10px;'>\n";
-    cout << "<input type='text' name='newStrategy' placeholder='Enter a new coping strategy'>\n";
-    cout << "<button type='submit' name='action' value='addCustomStrategy' class='btn-primary'>Add Custom</button>\n";
-    cout << "</form>\n";
-    cout << "</div>\n";
-    cout << "</div>\n";
-    
-    // Statistics Panel
-    cout << "<div class='panel'>\n";
-    cout << "<div class='panel-header stats'><span>📈</span> Mood Statistics</div>\n";
-    cout << "<div class='panel-content'>\n";
-    
-    if (state.moodStatistics.empty()) {
-        cout << "<div class='empty-message'>No statistics yet. Start tracking your mood!</div>\n";
-    } else {
-        // Calculate total mood entries
-        int total = 0;
-        for (const auto& stat : state.moodStatistics) {
-            total += stat.second;
+    // Reused across requests on this worker so rendering does not allocate
+    static thread_local string page;
+    page.clear();
+    bool compact = false;
+    bool notModified = false;
+    string_view failure; // answered with a 500 instead of the page
+    string cacheControl;
+    unsigned long long batch = 0; // group commit to wait for before answering
+    MoodEvent logged = {0, 0, UNKNOWN_MOOD}; // mood to count once the batch is on disk
+    
+    // Reads render the published copy and only take the shard lock to load
+    // a user who isn't cached yet or copy their latest changes. Writers
+    // render the cached state itself, before letting go of the lock.
+    StateShard& shard = ctx.shardFor(session);
+    timer.enter(PHASE_LOAD);
+    shared_ptr<const MentalHealthState> state;
+    if (anonymous) {
+        auto defaults = make_shared<MentalHealthState>();
+        restoreState(paths, config, *defaults); // nothing there to read
+        state = defaults;
+    } else if (!mutating) {
+        state = shard.current(session, config);
+    }
+    const MentalHealthState* view = state.get();
+    unique_lock<mutex> lock(shard.m, defer_lock);
+    if (state == nullptr) {
+        lock.lock();
+        if (mutating || hasLegacyState()) {
+            ensureUserStateDir(session);
         }
-        
-        cout << "<div class='stats-grid'>\n";
-        for (const auto& stat : state.moodStatistics) {
-            int percentage = total > 0 ? (stat.second * 100) / total : 0;
-            cout << "<div class='stat-item'>\n";
-            cout << "<div class='stat-value'>" << stat.second << "</div>\n";
-            cout << "<div class='stat-label'>" << stat.first << " " << config.moodEmojis.at(stat.first) << "</div>\n";
-            cout << "<div class='progress-bar'><div class='progress-fill' style='width: " << percentage << "%'></div></div>\n";
-            cout << "</div>\n";
-        }
-        cout << "</div>\n";
-        
-        // Find most common mood
-        string mostCommonMood;
-        int maxCount = 0;
-        for (const auto& stat : state.moodStatistics) {
-            if (stat.second > maxCount) {
-                maxCount = stat.second;
-                mostCommonMood = stat.first;
+        if (revalidate && shard.find(session) == NULL) {
+            // Unchanged since the browser's copy: answer without loading the state
+            string etag = pageETag(session, peekStateVersion(paths), config);
+            notModified = etagMatches(req.headers["if-none-match"], etag);
+            if (notModified) cacheControl = cacheHeaders(etag);
+        }
+        MentalHealthState* working = notModified ? NULL : shard.acquire(session, config);
+        if (working != NULL) {
+            ActionResult result = mutating ? handleAction(*working, paths, config, params, timer, &ctx.commits, &batch)
+                                           : ACTION_NONE;
+            if (result == ACTION_FAILED) {
+                // Reload from disk next time rather than show a change that was not saved
+                shard.drop(session);
+                failure = SAVE_FAILED_MESSAGE;
+            } else if (mutating) {
+                if (result == ACTION_APPLIED) {
+                    compact = logNeedsCompaction(paths);
+                    shard.unpublish(session);
+                    const MoodSeries& moods = working->moodHistory;
+                    if (params.action == "logMood" && !moods.times.empty()) {
+                        logged = {moods.eventsRecorded, moods.times[moods.size() - 1], moods.moods[moods.size() - 1]};
+                    }
+                }
+                view = working;
+            } else {
+                state = shard.readLocked(session, config);
+                view = state.get();
+                lock.unlock();
             }
+        } else if (!notModified) {
+            failure = STATE_UNREADABLE_MESSAGE;
+        }
+    }
+    if (view != NULL) {
+        string etag = pageETag(session, view->version, config);
+        notModified = revalidate && etagMatches(req.headers["if-none-match"], etag);
+        timer.enter(PHASE_RENDER);
+        if (notModified) {
+            cacheControl = cacheHeaders(etag);
+        } else if (json) {
+            cacheControl = "Cache-Control: no-store\r\nVary: Cookie, Accept\r\n";
+            appendJsonState(page, *view, params, config);
+        } else {
+            cacheControl = cacheHeaders(etag);
+            printPage(page, *view, config, preparePageExtras(paths, *view, params, config));
         }
-        
-        cout << "<div class='current-value'>\n";
-        cout << "<strong>Most common mood:</strong> " << mostCommonMood << " " << config.moodEmojis.at(mostCommonMood) << "\n";
-        cout << "<div class='timestamp'>" << maxCount << " recorded instances</div>\n";
-        cout << "</div>\n";
     }
-    cout << "</div>\n";
-    cout << "</div>\n";
+    if (lock.owns_lock()) lock.unlock();
+    timer.enter(-1);
     
-    cout << "</div>\n";
-    cout << "</body>\n";
-    cout << "</html>\n";
+    // A change is only acknowledged once its batch is on disk
+    if (batch > 0) {
+        timer.enter(PHASE_SAVE);
+        if (ctx.commits.wait(batch)) {
+            if (logged.mood != UNKNOWN_MOOD) countPopulationMood(logged.time, logged.mood);
+        } else {
+            // Readers must not go on seeing a change that never reached the disk
+            lock_guard<mutex> lock(shard.m);
+            shard.drop(session);
+            failure = SAVE_FAILED_MESSAGE;
+            compact = false;
+        }
+        timer.enter(-1);
+    }
+    if (compact) requestCompaction(ctx, session);
+    if (!failure.empty()) {
+        page = failure;
+        cacheControl = "Cache-Control: no-store\r\n";
+    }
+    extraHeaders += cacheControl + timer.serverTimingHeader();
+    int status = notModified ? 304 : failure.empty() ? 200 : 500;
+    const char* contentType = !failure.empty() ? "text/plain" : json ? "application/json" : "text/html";
+    bool ok = sendHttpResponse(fd, status, contentType, extraHeaders, page, req.keepAlive);
+    recordRequestMetrics(metricActionIndex(params.action), timer);
+    return ok;
 }
 
-string urlDecode(const string& encoded) {
-    string decoded = encoded;
-    size_t pos = 0;
-    while ((pos = decoded.find('+', pos)) != string::npos) {
-        decoded.replace(pos, 1, " ");
-        pos++;
+// Answers one parsed request on 'fd'. Returns false if the connection
+// should not be reused.
+bool dispatchRequest(ServerContext& ctx, int fd, HttpRequest& req) {
+    if (req.path != "/" && req.path != "/hello.cgi" && req.path != "/cgi-bin/hello.cgi") {
+        return sendHttpResponse(fd, 404, "text/plain", "", "Not found\n", req.keepAlive);
     }
-    pos = 0;
-    while ((pos = decoded.find('%', pos)) != string::npos) {
-        if (pos + 2 < decoded.length()) {
-            string hex = decoded.substr(pos + 1, 2);
-            char chr = static_cast<char>(stoi(hex, nullptr, 16));
-            decoded.replace(pos, 3, string(1, chr));
-        }
-        pos++;
+    RequestTimer timer;
+    timer.enter(PHASE_CONFIG);
+    shared_ptr<const AppConfig> config = currentConfig();
+    timer.enter(-1);
+    // An import names itself in the query string; its body is data, not a form
+    RequestParams params = parseRequest(req.query, "");
+    if (params.action != "import" && isFormBody(req.headers["content-type"]) && req.unreadBodyBytes == 0) {
+        params = parseRequest(req.query, req.body);
     }
-    return decoded;
+    if (params.action == "import" && req.method == "POST") {
+        return serveImport(ctx, fd, req, *config, params, timer);
+    } else if (req.unreadBodyBytes > 0) {
+        req.keepAlive = false;
+        return sendHttpResponse(fd, 413, "text/plain", "", "Request body too large\n", false);
+    } else if (params.action == "import") {
+        return sendHttpResponse(fd, 405, "text/plain", "Allow: POST\r\n", IMPORT_NEEDS_POST_MESSAGE, req.keepAlive);
+    } else if (params.action == "export") {
+        return serveExport(ctx, fd, req, *config, params, timer);
+    } else if (params.action == "metrics") {
+        return serveMetrics(ctx, fd, req, *config, timer);
+    } else if (params.action == "population") {
+        return servePopulation(fd, req, *config, params, timer);
+    }
+    return servePage(ctx, fd, req, *config, params, timer);
 }
 
-int main() {
-    AppConfig config = loadConfig();
-    MentalHealthState state = loadState();
+void serveConnection(ServerContext& ctx, int fd) {
+    string buffer;
+    HttpRequest req;
     
-    if (state.copingStrategies.empty()) {
-        for (const auto& strategy : config.defaultStrategies) {
-            state.copingStrategies.push_back(strategy);
+    while (readHttpRequest(fd, buffer, req)) {
+        if (!dispatchRequest(ctx, fd, req) || !req.keepAlive) break;
+        req = HttpRequest();
+    }
+    close(fd);
+}
+
+int runServer(int port, int threads) {
+    if (threads <= 0) threads = max(1u, thread::hardware_concurrency());
+    signal(SIGPIPE, SIG_IGN);
+    
+    ServerContext ctx;
+    currentConfig(); // reports config problems at startup
+    
+    int listenFd = socket(AF_INET, SOCK_STREAM, 0);
+    if (listenFd < 0) {
+        perror("socket");
+        return 1;
+    }
+    int one = 1;
+    setsockopt(listenFd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(listenFd, (sockaddr*)&addr, sizeof(addr)) < 0 || listen(listenFd, 128) < 0) {
+        perror("bind/listen");
+        close(listenFd);
+        return 1;
+    }
+    cerr << "Mental Health Simulator listening on http://127.0.0.1:" << port
+         << " with " << threads << " worker threads" << endl;
+    
+    thread compactor(runCompactor, ref(ctx));
+    compactor.detach();
+    thread syncer(runGroupCommit, ref(ctx.commits));
+    syncer.detach();
+    thread aggregator(runAggregator);
+    aggregator.detach();
+    
+    ConnectionQueue pending;
+    vector<thread> workers;
+    for (int i = 0; i < threads; i++) {
+        workers.emplace_back([&ctx, &pending] {
+            while (true) {
+                serveConnection(ctx, pending.pop());
+            }
+        });
+    }
+    
+    while (true) {
+        int fd = accept(listenFd, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR) continue;
+            perror("accept");
+            break;
         }
+        // Idle keep-alive connections must not pin a worker forever
+        timeval timeout = {5, 0};
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        pending.push(fd);
+    }
+    
+    close(listenFd);
+    for (auto& worker : workers) worker.detach();
+    return 1;
+}
+
+// bench.cpp includes this file with MHS_NO_MAIN defined to drive the
+// functions above directly.
+#ifndef MHS_NO_MAIN
+int main(int argc, char* argv[]) {
+    // Apache hands ISINDEX-style query strings to CGI scripts as argv, so the
+    // command line is only trusted when we are not running under CGI.
+    if (argc > 1 && getenv("GATEWAY_INTERFACE") == NULL && string(argv[1]) == "--serve") {
+        int port = argc > 2 ? atoi(argv[2]) : 8080;
+        int threads = argc > 3 ? atoi(argv[3]) : 0;
+        return runServer(port, threads);
     }
     
+    RequestTimer timer;
+    timer.enter(PHASE_CONFIG);
+    shared_ptr<const AppConfig> configRef = currentConfig();
+    const AppConfig& config = *configRef;
+    timer.enter(-1);
+    
     char* query = getenv("QUERY_STRING");
-    string action, moodInput, thoughtInput, newStrategy;
+    char* method = getenv("REQUEST_METHOD");
+    char* contentType = getenv("CONTENT_TYPE");
+    char* contentLength = getenv("CONTENT_LENGTH");
+    bool isGet = method == NULL || strcmp(method, "GET") == 0;
     
-    if (query != NULL) {
-        string qs(query);
-        
-        size_t aPos = qs.find("action=");
-        if (aPos != string::npos) {
-            size_t endPos = qs.find("&", aPos);
-            if (endPos == string::npos) endPos = qs.length();
-            action = qs.substr(aPos + 7, endPos - (aPos + 7));
-        }
-        
-        size_t mPos = qs.find("moodInput=");
-        if (mPos != string::npos) {
-            size_t endPos = qs.find("&", mPos);
-            if (endPos == string::npos) endPos = qs.length();
-            moodInput = urlDecode(qs.substr(mPos + 10, endPos - (mPos + 10)));
-        }
-        
-        size_t tPos = qs.find("thoughtInput=");
-        if (tPos != string::npos) {
-            size_t endPos = qs.find("&", tPos);
-            if (endPos == string::npos) endPos = qs.length();
-            thoughtInput = urlDecode(qs.substr(tPos + 13, endPos - (tPos + 13)));
-        }
-        
-        size_t sPos = qs.find("newStrategy=");
-        if (sPos != string::npos) {
-            size_t endPos = qs.find("&", sPos);
-            if (endPos == string::npos) endPos = qs.length();
-            newStrategy = urlDecode(qs.substr(sPos + 12, endPos - (sPos + 12)));
+    // Long thoughts arrive as a POSTed form on stdin; an import streams its
+    // records from there instead
+    bool import = method != NULL && strcmp(method, "POST") == 0 &&
+                  parseRequest(query != NULL ? query : "", "").action == "import";
+    string formBody;
+    if (!import && !isGet && contentType != NULL && isFormBody(contentType) && contentLength != NULL) {
+        size_t length = min<size_t>(strtoul(contentLength, NULL, 10), MAX_FORM_BODY_BYTES);
+        formBody.resize(length);
+        size_t got = 0;
+        while (got < length) {
+            ssize_t n = read(STDIN_FILENO, &formBody[got], length - got);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) break;
+            got += n;
         }
+        formBody.resize(got);
+    }
+    RequestParams params = parseRequest(query != NULL ? query : "", formBody);
+    
+    size_t metricAction = metricActionIndex(params.action);
+    
+    if (params.action == "import" && !import) {
+        string head = "Status: 405 Method Not Allowed\r\nAllow: POST\r\n" + timer.serverTimingHeader() +
+                      "Cache-Control: no-store\r\nContent-type: text/plain\r\n\r\n";
+        writeResponse(STDOUT_FILENO, head, IMPORT_NEEDS_POST_MESSAGE);
+        recordRequestMetrics(metricAction, timer);
+        return 0;
     }
     
-    if (action == "logMood" && !moodInput.empty()) {
-        state.moodStatistics[moodInput]++;
-        if (state.currentMood != moodInput) {
-            state.moodHistory.push_back(state.currentMood);
+    char* cookies = getenv("HTTP_COOKIE");
+    string session = sessionFromCookies(cookies != NULL ? cookies : "");
+    bool newSession = session.empty();
+    if (newSession) session = newSessionId();
+    StatePaths paths = statePathsIn(userStateDir(session));
+    
+    // Scrapers have no session; they get the server-wide part only and no
+    // session or state directory is created for them
+    if (params.action == "metrics") {
+        string body;
+        appendServerMetrics(body);
+        if (!newSession && access(paths.dir.c_str(), F_OK) == 0) {
+            lockUserState(paths, LOCK_SH);
+            timer.enter(PHASE_LOAD);
+            MentalHealthState state;
+            if (restoreState(paths, config, state)) appendStateMetrics(body, paths, state);
+            timer.enter(-1);
         }
-        state.currentMood = moodInput;
+        string head = timer.serverTimingHeader() + "Cache-Control: no-store\r\nContent-type: text/plain; version=0.0.4\r\n\r\n";
+        writeResponse(STDOUT_FILENO, head, body);
+        recordRequestMetrics(metricAction, timer);
+        return 0;
     }
-    else if (action == "addThought" && !thoughtInput.empty()) {
-        string timestamp = config.enableTimestamps ? getTimestamp() : "";
-        state.thoughtJournal.push_back({thoughtInput, timestamp});
+    
+    if (params.action == "population") {
+        string body;
+        int status = populationReport(config, params, timer, body);
+        string head = status == 200 ? "" : "Status: 403 Forbidden\r\n";
+        head += timer.serverTimingHeader() + "Cache-Control: no-store\r\nContent-type: ";
+        head += status == 200 ? "application/json\r\n\r\n" : "text/plain\r\n\r\n";
+        writeResponse(STDOUT_FILENO, head, body);
+        recordRequestMetrics(metricAction, timer);
+        return 0;
     }
-    else if (action == "suggestStrategy" && !state.copingStrategies.empty()) {
-        string strategy = state.copingStrategies.front();
-        state.copingStrategies.pop_front();
-        state.copingStrategies.push_back(strategy);
+    
+    if (params.action == "export") {
+        MentalHealthState state;
+        if (!newSession && access(paths.dir.c_str(), F_OK) == 0) {
+            lockUserState(paths, LOCK_SH);
+            timer.enter(PHASE_LOAD);
+            bool restored = restoreState(paths, config, state);
+            timer.enter(-1);
+            if (!restored) {
+                string head = "Status: 500 Internal Server Error\r\n" + timer.serverTimingHeader() +
+                              "Cache-Control: no-store\r\nContent-type: text/plain\r\n\r\n";
+                writeResponse(STDOUT_FILENO, head, STATE_UNREADABLE_MESSAGE);
+                recordRequestMetrics(metricAction, timer);
+                return 0;
+            }
+        }
+        bool jsonl = wantsJsonl(params, "");
+        string head = exportHeaders(jsonl) + timer.serverTimingHeader() + "Cache-Control: no-store\r\n\r\n";
+        writeAll(STDOUT_FILENO, head.data(), head.size());
+        timer.enter(PHASE_RENDER);
+        ChunkedWriter out(STDOUT_FILENO, false);
+        exportState(paths, state, jsonl, out);
+        timer.enter(-1);
+        recordRequestMetrics(metricAction, timer);
+        return 0;
     }
-    else if (action == "useStrategy" && !state.copingStrategies.empty()) {
-        state.lastStrategyUsed = state.copingStrategies.front();
-        state.lastStrategyTime = time(0);
+    
+    // Writers (and the one request that adopts the old single-user files)
+    // lock exclusively, page views share the lock. Released at exit.
+    bool mutating = isMutatingAction(params.action);
+    bool adopting = hasLegacyState();
+    // A new user's import creates their directory with its first batch
+    bool importCreatesDir = import && !adopting && access(paths.dir.c_str(), F_OK) != 0;
+    if ((mutating && !importCreatesDir) || adopting) {
+        ensureUserStateDir(session);
+        lockUserState(paths, LOCK_EX);
+    } else {
+        lockUserState(paths, LOCK_SH);
     }
-    else if (action == "addStrategy") {
-        if (!config.defaultStrategies.empty()) {
-            static random_device rd;
-            static mt19937 gen(rd());
-            uniform_int_distribution<> dis(0, (int)config.defaultStrategies.size() - 1);
-            string strategy = config.defaultStrategies[dis(gen)];
-            state.copingStrategies.push_back(strategy);
+    // A visitor who only reads is shown the defaults and gets no session
+    // until their first write
+    bool setCookie = newSession && (mutating || adopting);
+    
+    // Unchanged since the browser's copy: answer without loading the state
+    char* accept = getenv("HTTP_ACCEPT");
+    bool json = wantsJsonApi(params, accept != NULL ? accept : "");
+    char* ifNoneMatch = getenv("HTTP_IF_NONE_MATCH");
+    if (!json && isGet && params.action.empty() && !newSession && ifNoneMatch != NULL) {
+        timer.enter(PHASE_LOAD);
+        string etag = pageETag(session, peekStateVersion(paths), config);
+        timer.enter(-1);
+        if (etagMatches(ifNoneMatch, etag)) {
+            string head = "Status: 304 Not Modified\r\n" + timer.serverTimingHeader() + cacheHeaders(etag) + "\r\n";
+            writeResponse(STDOUT_FILENO, head, "");
+            recordRequestMetrics(metricAction, timer);
+            return 0;
         }
     }
-    else if (action == "addCustomStrategy" && !newStrategy.empty()) {
-        state.copingStrategies.push_back(newStrategy);
+    
+    timer.enter(PHASE_LOAD);
+    MentalHealthState state;
+    bool restored = restoreState(paths, config, state);
+    
+    // Nothing is written over a snapshot that could not be read, and a read
+    // writes nothing at all
+    ActionResult result = ACTION_NONE;
+    if (restored && mutating && !import) result = handleAction(state, paths, config, params, timer);
+    if (!restored || result == ACTION_FAILED) {
+        timer.enter(-1);
+        string head = setCookie ? sessionCookieHeader(session) : "";
+        head += "Status: 500 Internal Server Error\r\n" + timer.serverTimingHeader() +
+                "Cache-Control: no-store\r\nContent-type: text/plain\r\n\r\n";
+        writeResponse(STDOUT_FILENO, head, restored ? SAVE_FAILED_MESSAGE : STATE_UNREADABLE_MESSAGE);
+        recordRequestMetrics(metricAction, timer);
+        return 0;
     }
     
-    if (state.moodHistory.size() > (size_t)config.maxHistoryItems) {
-        state.moodHistory.erase(state.moodHistory.begin(), 
-                               state.moodHistory.end() - config.maxHistoryItems);
+    if (import) {
+        BodySource body;
+        body.fd = STDIN_FILENO;
+        body.remaining = contentLength != NULL ? strtoull(contentLength, NULL, 10) : 0;
+        timer.enter(PHASE_ACTION);
+        ImportSummary summary = importRecords(body, wantsJsonl(params, contentType != NULL ? contentType : ""),
+                                              [&](const vector<Mutation>& batch) {
+            timer.enter(PHASE_SAVE);
+            if (importCreatesDir) {
+                // Another request may have created the user meanwhile; start from what it left
+                importCreatesDir = false;
+                state = MentalHealthState();
+                if (!ensureUserStateDir(session) || lockUserState(paths, LOCK_EX) < 0 ||
+                    !restoreState(paths, config, state)) {
+                    return false;
+                }
+            }
+            bool ok = commitImportBatch(state, paths, batch);
+            timer.enter(PHASE_ACTION);
+            return ok;
+        });
+        timer.enter(-1);
+        string head = setCookie ? sessionCookieHeader(session) : "";
+        if (summary.failed) head += "Status: 500 Internal Server Error\r\n";
+        head += timer.serverTimingHeader() + "Cache-Control: no-store\r\nContent-type: text/plain\r\n\r\n";
+        writeResponse(STDOUT_FILENO, head, importReport(summary));
+        recordRequestMetrics(metricAction, timer);
+        return 0;
     }
-    if (state.thoughtJournal.size() > (size_t)config.maxHistoryItems) {
-        state.thoughtJournal.erase(state.thoughtJournal.begin(), 
-                                  state.thoughtJournal.end() - config.maxHistoryItems);
+    
+    timer.enter(PHASE_RENDER);
+    string page;
+    page.reserve(32 * 1024);
+    if (json) {
+        appendJsonState(page, state, params, config);
+    } else {
+        printPage(page, state, config, preparePageExtras(paths, state, params, config));
     }
+    timer.enter(-1);
+    
+    string head = setCookie ? sessionCookieHeader(session) : "";
+    head += json ? "Cache-Control: no-store\r\nVary: Cookie, Accept\r\n" : cacheHeaders(pageETag(session, state.version, config));
+    head += timer.serverTimingHeader();
+    head += json ? "Content-type: application/json\r\n\r\n" : "Content-type: text/html\r\n\r\n";
+    writeResponse(STDOUT_FILENO, head, page);
+    recordRequestMetrics(metricAction, timer);
     
-    saveState(state, config);
-    printPage(state, config);
+    // Without a server to do it in the background, writers take turns
+    // compacting their log and merging the population counters
+    bool compact = result == ACTION_APPLIED && logNeedsCompaction(paths);
+    bool merge = result == ACTION_APPLIED && populationMergeDue();
+    if (compact || merge) {
+        // Hand the finished page to the web server first
+        close(STDOUT_FILENO);
+    }
+    if (compact) {
+        RequestTimer compaction;
+        compaction.enter(PHASE_SAVE);
+        beginCompaction(paths);
+        finishCompaction(paths, state);
+        compaction.enter(-1);
+        recordRequestMetrics(metricActionIndex("compaction"), compaction);
+    }
+    if (merge) mergePopulationMoods(false);
     return 0;
 }
+#endif
@@ -0,0 +1,593 @@
+// Load generator for hello.cpp. Simulates a population of users whose moods
+// follow a Markov chain over the configured moods, who journal in bursts and
+// use coping strategies, or replays a recorded access log. Reports
+// throughput and latency percentiles per action.
+//
+//   g++ -std=c++17 -O2 -pthread loadgen.cpp -o loadgen
+//   ./loadgen --users 1000000 --requests 2000000         # in process, through the server's handlers
+//   ./loadgen --target http://127.0.0.1:8080 --duration 30
+//   ./loadgen --cgi ./hello.cgi --users 100 --requests 2000
+//   ./loadgen --replay access.log --target http://127.0.0.1:8080
+//   ./loadgen --json ...                                   # one JSON object per action
+#define MHS_NO_MAIN
+#include "hello.cpp"
+
+#include <atomic>
+#include <netdb.h>
+#include <netinet/tcp.h>
+#include <sys/wait.h>
+
+struct LoadOptions {
+    size_t users = 10000;
+    size_t requests = 100000; // stop after this many requests...
+    bool requestsSet = false;
+    double duration = 0;      // ...or after this many seconds, if set
+    int threads = 0;          // 0 = one per core
+    uint64_t seed = 1;
+    string target;            // http://host[:port][/path]: drive a running --serve
+    string cgi;               // run this CGI binary once per request
+    string replay;            // access log to replay instead of the synthetic population
+    string dataDir;           // in process and CGI: where user state goes
+    bool json = false;
+};
+
+enum DriverKind { DRIVER_IN_PROCESS, DRIVER_HTTP, DRIVER_CGI };
+
+// One per worker thread. send() returns the HTTP status, 0 if the request
+// never got an answer.
+struct Client {
+    DriverKind kind = DRIVER_IN_PROCESS;
+
+    // In process: the server's handlers write into a memory file
+    ServerContext* ctx = nullptr;
+    int out = -1;
+
+    // HTTP: one keep-alive connection
+    sockaddr_storage addr = {};
+    socklen_t addrLength = 0;
+    string host;
+    string path = "/";
+    int fd = -1;
+    string buffer;
+
+    // CGI
+    string cgi;
+
+    int send(const string& session, const string& query);
+    int sendInProcess(const string& session, const string& query);
+    int sendHttp(const string& session, const string& query);
+    int readHttpResponse();
+    int sendCgi(const string& session, const string& query);
+};
+
+int Client::send(const string& session, const string& query) {
+    switch (kind) {
+    case DRIVER_HTTP: return sendHttp(session, query);
+    case DRIVER_CGI: return sendCgi(session, query);
+    default: return sendInProcess(session, query);
+    }
+}
+
+int Client::sendInProcess(const string& session, const string& query) {
+    HttpRequest req;
+    req.method = "GET";
+    req.path = "/";
+    req.query = query;
+    req.headers["cookie"] = SESSION_COOKIE + "=" + session;
+    req.keepAlive = true;
+    if (lseek(out, 0, SEEK_SET) != 0 || ftruncate(out, 0) != 0) return 0;
+    dispatchRequest(*ctx, out, req);
+    char status[13] = {};
+    if (pread(out, status, 12, 0) != 12) return 0;
+    return atoi(status + 9);
+}
+
+int Client::sendHttp(const string& session, const string& query) {
+    string request = "GET " + path + (query.empty() ? "" : "?" + query) + " HTTP/1.1\r\nHost: " + host +
+                     "\r\nCookie: " + SESSION_COOKIE + "=" + session + "\r\n\r\n";
+    // A kept-alive connection the server has since closed gets one retry
+    for (int attempt = 0; attempt < 2; attempt++) {
+        if (fd < 0) {
+            fd = socket(addr.ss_family, SOCK_STREAM, 0);
+            if (fd < 0) return 0;
+            int one = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+            timeval timeout = {30, 0};
+            setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+            if (connect(fd, (sockaddr*)&addr, addrLength) != 0) {
+                close(fd);
+                fd = -1;
+                return 0;
+            }
+        }
+        if (writeAll(fd, request.data(), request.size())) {
+            int status = readHttpResponse();
+            if (status > 0) return status;
+        }
+        close(fd);
+        fd = -1;
+        buffer.clear();
+    }
+    return 0;
+}
+
+// Reads one response, body included, and returns its status (0 = broken)
+int Client::readHttpResponse() {
+    auto fill = [this]() {
+        char chunk[16384];
+        ssize_t n;
+        do {
+            n = read(fd, chunk, sizeof(chunk));
+        } while (n < 0 && errno == EINTR);
+        if (n <= 0) return false;
+        buffer.append(chunk, n);
+        return true;
+    };
+    size_t headerEnd;
+    while ((headerEnd = buffer.find("\r\n\r\n")) == string::npos) {
+        if (!fill()) return 0;
+    }
+    string head = buffer.substr(0, headerEnd + 2);
+    buffer.erase(0, headerEnd + 4);
+    int status = head.size() > 12 ? atoi(head.c_str() + 9) : 0;
+    transform(head.begin(), head.end(), head.begin(), ::tolower);
+
+    if (head.find("\r\ntransfer-encoding: chunked\r\n") != string::npos) {
+        while (true) {
+            size_t eol;
+            while ((eol = buffer.find("\r\n")) == string::npos) {
+                if (!fill()) return 0;
+            }
+            size_t size = strtoul(buffer.c_str(), NULL, 16);
+            while (buffer.size() < eol + 2 + size + 2) {
+                if (!fill()) return 0;
+            }
+            buffer.erase(0, eol + 2 + size + 2);
+            if (size == 0) break;
+        }
+    } else {
+        size_t length = 0;
+        size_t field = head.find("\r\ncontent-length:");
+        if (field != string::npos) length = strtoul(head.c_str() + field + 17, NULL, 10);
+        while (buffer.size() < length) {
+            if (!fill()) return 0;
+        }
+        buffer.erase(0, length);
+    }
+    if (head.find("\r\nconnection: close\r\n") != string::npos) {
+        close(fd);
+        fd = -1;
+        buffer.clear();
+    }
+    return status;
+}
+
+int Client::sendCgi(const string& session, const string& query) {
+    // Everything the child needs is built before fork(): only
+    // async-signal-safe calls are allowed between fork() and exec() in a
+    // threaded process
+    string queryVar = "QUERY_STRING=" + query;
+    string cookieVar = "HTTP_COOKIE=" + SESSION_COOKIE + "=" + session;
+    const char* envp[] = {"GATEWAY_INTERFACE=CGI/1.1", "REQUEST_METHOD=GET", "PATH=/usr/bin:/bin",
+                          queryVar.c_str(), cookieVar.c_str(), NULL};
+    const char* argv[] = {cgi.c_str(), NULL};
+    int pipeFds[2];
+    if (pipe(pipeFds) != 0) return 0;
+    pid_t pid = fork();
+    if (pid < 0) {
+        close(pipeFds[0]);
+        close(pipeFds[1]);
+        return 0;
+    }
+    if (pid == 0) {
+        int devNull = open("/dev/null", O_RDONLY);
+        dup2(devNull, STDIN_FILENO);
+        dup2(pipeFds[1], STDOUT_FILENO);
+        close(pipeFds[0]);
+        close(pipeFds[1]);
+        execve(cgi.c_str(), (char* const*)argv, (char* const*)envp);
+        _exit(127);
+    }
+    close(pipeFds[1]);
+    string output;
+    char chunk[16384];
+    ssize_t n;
+    while ((n = read(pipeFds[0], chunk, sizeof(chunk))) != 0) {
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        output.append(chunk, n);
+    }
+    close(pipeFds[0]);
+    int exitStatus = 0;
+    while (waitpid(pid, &exitStatus, 0) < 0 && errno == EINTR) {
+    }
+    if (!WIFEXITED(exitStatus) || WEXITSTATUS(exitStatus) != 0 || output.empty()) return 0;
+    // CGI scripts only send a Status: header when the answer isn't 200
+    size_t headEnd = output.find("\r\n\r\n");
+    string head = output.substr(0, headEnd == string::npos ? output.size() : headEnd + 2);
+    size_t field = head.find("Status: ");
+    return (field == 0 || (field != string::npos && head[field - 1] == '\n')) ? atoi(head.c_str() + field + 8) : 200;
+}
+
+// ---------------------------------------------------------------------------
+// Synthetic population
+// ---------------------------------------------------------------------------
+
+uint64_t splitMix64(uint64_t x) {
+    x += 0x9e3779b97f4a7c15ULL;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+// The same user gets the same session on every run with the same seed
+string syntheticSession(uint64_t seed, uint64_t user) {
+    char session[33];
+    uint64_t high = splitMix64(seed ^ splitMix64(user));
+    snprintf(session, sizeof(session), "%016llx%016llx", (unsigned long long)high,
+             (unsigned long long)splitMix64(high));
+    return session;
+}
+
+// How pleasant a mood is. Moods mostly drift to neighbours on this scale
+// rather than jump from Happy to Angry.
+int moodValence(MoodId id) {
+    static const pair<string_view, int> valences[] = {
+        {"Happy", 2}, {"Excited", 2}, {"Calm", 1}, {"Neutral", 0}, {"Tired", -1},
+        {"Sad", -2}, {"Anxious", -2}, {"Stressed", -2}, {"Angry", -3}};
+    for (const auto& valence : valences) {
+        if (moodName(id) == valence.first) return valence.second;
+    }
+    return 0;
+}
+
+const double MOOD_STAY_PROBABILITY = 0.5;
+
+// Row i gives the next mood after offered mood i: stay with
+// MOOD_STAY_PROBABILITY, otherwise move with weight e^-|valence difference|
+vector<discrete_distribution<size_t>> moodTransitions(const vector<MoodId>& moods) {
+    vector<discrete_distribution<size_t>> rows;
+    for (size_t i = 0; i < moods.size(); i++) {
+        vector<double> weights(moods.size(), 0.0);
+        double moving = 0;
+        for (size_t j = 0; j < moods.size(); j++) {
+            if (j != i) moving += weights[j] = exp(-abs(moodValence(moods[i]) - moodValence(moods[j])));
+        }
+        for (size_t j = 0; j < moods.size(); j++) {
+            weights[j] = j == i ? (moods.size() == 1 ? 1.0 : MOOD_STAY_PROBABILITY)
+                                : (1 - MOOD_STAY_PROBABILITY) * weights[j] / moving;
+        }
+        rows.emplace_back(weights.begin(), weights.end());
+    }
+    return rows;
+}
+
+const char* const JOURNAL_WORDS[] = {
+    "slept", "badly", "well", "work", "meeting", "deadline", "friend", "called", "walk", "park", "rain", "sun",
+    "tired", "grateful", "dinner", "family", "argument", "exercise", "coffee", "anxious", "calm", "music",
+    "reading", "late", "early", "headache", "weekend", "project", "finally", "again", "today", "tomorrow"};
+
+const char* const CUSTOM_STRATEGIES[] = {
+    "Box+breathing", "Cold+water+on+face", "Five+senses+check", "Text+a+friend", "Tidy+one+shelf",
+    "Step+outside", "Write+it+down", "Stretch+for+two+minutes", "Make+tea", "Name+the+feeling"};
+
+struct Request {
+    string label; // the action, "view" for the dashboard
+    string query;
+};
+
+// One visit: the dashboard, then whatever the user does this time
+void planVisit(mt19937_64& random, const vector<MoodId>& moods, vector<discrete_distribution<size_t>>& transitions,
+               uint8_t& mood, vector<Request>& visit) {
+    auto chance = [&random](double p) { return uniform_real_distribution<double>(0, 1)(random) < p; };
+    visit.push_back({"view", ""});
+    if (chance(0.6) && !moods.empty()) {
+        mood = (uint8_t)transitions[mood](random);
+        visit.push_back({"logMood", "action=logMood&moodInput=" + string(moodName(moods[mood]))});
+    }
+    if (chance(0.25)) {
+        // Journaling comes in bursts: a geometric number of entries, 2 on average
+        do {
+            string text;
+            size_t words = uniform_int_distribution<size_t>(4, 16)(random);
+            for (size_t i = 0; i < words; i++) {
+                if (i > 0) text += '+';
+                text += JOURNAL_WORDS[random() % size(JOURNAL_WORDS)];
+            }
+            visit.push_back({"addThought", "action=addThought&thoughtInput=" + text});
+        } while (chance(0.5));
+    }
+    if (chance(0.2)) {
+        visit.push_back({"suggestStrategy", "action=suggestStrategy"});
+        if (chance(0.7)) visit.push_back({"useStrategy", "action=useStrategy"});
+    }
+    if (chance(0.02)) {
+        visit.push_back({"addCustomStrategy",
+                         "action=addCustomStrategy&newStrategy=" + string(CUSTOM_STRATEGIES[random() % size(CUSTOM_STRATEGIES)])});
+    }
+    if (chance(0.1)) {
+        static const char* const kinds[] = {"moods", "thoughts", "strategies"};
+        visit.push_back({"history", string("action=history&kind=") + kinds[random() % 3]});
+    }
+    if (chance(0.05)) {
+        visit.push_back({"searchThoughts", string("action=searchThoughts&q=") + JOURNAL_WORDS[random() % size(JOURNAL_WORDS)]});
+    }
+    if (chance(0.05)) visit.push_back({"moodTrends", "action=moodTrends"});
+    if (chance(0.15)) visit.push_back({"json", "format=json"});
+}
+
+// ---------------------------------------------------------------------------
+// Access log replay
+// ---------------------------------------------------------------------------
+
+// Client and request target of a Common/Combined Log Format line:
+//   10.0.0.7 - - [17/Oct/2026:13:55:36 +0000] "GET /cgi-bin/hello.cgi?action=logMood&moodInput=Happy HTTP/1.1" 200 2326
+bool parseAccessLogLine(const string& line, string& client, string& method, string& query) {
+    size_t clientEnd = line.find(' ');
+    size_t quote = line.find('"');
+    if (clientEnd == string::npos || quote == string::npos) return false;
+    size_t methodEnd = line.find(' ', quote + 1);
+    if (methodEnd == string::npos) return false;
+    size_t targetEnd = line.find(' ', methodEnd + 1);
+    size_t closingQuote = line.find('"', methodEnd + 1);
+    if (closingQuote == string::npos) return false;
+    if (targetEnd == string::npos || targetEnd > closingQuote) targetEnd = closingQuote;
+    client = line.substr(0, clientEnd);
+    method = line.substr(quote + 1, methodEnd - quote - 1);
+    string target = line.substr(methodEnd + 1, targetEnd - methodEnd - 1);
+    size_t q = target.find('?');
+    query = q == string::npos ? "" : target.substr(q + 1);
+    return true;
+}
+
+string requestLabel(const string& query) {
+    RequestParams params = parseRequest(query, "");
+    if (!params.action.empty()) return params.action;
+    return params.format == "json" ? "json" : "view";
+}
+
+// ---------------------------------------------------------------------------
+// Workers and reporting
+// ---------------------------------------------------------------------------
+
+struct ActionStats {
+    vector<uint64_t> latencies; // nanoseconds, one per request
+    size_t errors = 0;          // no answer, or a status other than 200/304
+};
+
+struct Worker {
+    Client client;
+    map<string, ActionStats> stats;
+    vector<pair<string, Request>> replay; // session + request, in log order
+
+    void run(const Request& request, const string& session) {
+        auto start = chrono::steady_clock::now();
+        int status = client.send(session, request.query);
+        uint64_t ns = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count();
+        ActionStats& action = stats[request.label];
+        action.latencies.push_back(ns);
+        if (status != 200 && status != 304) action.errors++;
+    }
+};
+
+void reportStats(const LoadOptions& options, const string& label, ActionStats& stats, double seconds) {
+    vector<uint64_t>& latencies = stats.latencies;
+    if (latencies.empty()) return;
+    sort(latencies.begin(), latencies.end());
+    auto percentile = [&latencies](double p) {
+        return latencies[min(latencies.size() - 1, (size_t)(p * latencies.size()))] / 1e6;
+    };
+    double rate = latencies.size() / seconds;
+    if (options.json) {
+        printf("{\"action\":\"%s\",\"requests\":%zu,\"errors\":%zu,\"requests_per_sec\":%.1f,\"p50_ms\":%.3f,"
+               "\"p90_ms\":%.3f,\"p99_ms\":%.3f,\"p999_ms\":%.3f,\"max_ms\":%.3f}\n",
+               label.c_str(), latencies.size(), stats.errors, rate, percentile(0.5), percentile(0.9),
+               percentile(0.99), percentile(0.999), latencies.back() / 1e6);
+    } else {
+        printf("%-18s %10zu %8zu %11.1f %9.3f %9.3f %9.3f %9.3f %9.3f\n", label.c_str(), latencies.size(),
+               stats.errors, rate, percentile(0.5), percentile(0.9), percentile(0.99), percentile(0.999),
+               latencies.back() / 1e6);
+    }
+}
+
+bool parseTarget(const string& target, Client& client) {
+    string rest = target.compare(0, 7, "http://") == 0 ? target.substr(7) : target;
+    size_t slash = rest.find('/');
+    client.path = slash == string::npos ? "/" : rest.substr(slash);
+    client.host = rest.substr(0, slash);
+    string host = client.host, port = "80";
+    size_t colon = host.rfind(':');
+    if (colon != string::npos) {
+        port = host.substr(colon + 1);
+        host = host.substr(0, colon);
+    }
+    addrinfo hints = {};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo* found = NULL;
+    if (getaddrinfo(host.c_str(), port.c_str(), &hints, &found) != 0 || found == NULL) return false;
+    memcpy(&client.addr, found->ai_addr, found->ai_addrlen);
+    client.addrLength = found->ai_addrlen;
+    freeaddrinfo(found);
+    return true;
+}
+
+int usage(const char* program) {
+    fprintf(stderr,
+            "usage: %s [--users N] [--requests N | --duration SECONDS] [--threads N] [--seed N]\n"
+            "          [--target http://HOST:PORT/PATH | --cgi PATH] [--replay ACCESS_LOG] [--data DIR] [--json]\n",
+            program);
+    return 2;
+}
+
+int main(int argc, char* argv[]) {
+    LoadOptions options;
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        bool hasValue = i + 1 < argc;
+        if (arg == "--json") options.json = true;
+        else if (arg == "--users" && hasValue) options.users = max<size_t>(1, strtoull(argv[++i], NULL, 10));
+        else if (arg == "--requests" && hasValue) {
+            options.requests = strtoull(argv[++i], NULL, 10);
+            options.requestsSet = true;
+        }
+        else if (arg == "--duration" && hasValue) options.duration = atof(argv[++i]);
+        else if (arg == "--threads" && hasValue) options.threads = atoi(argv[++i]);
+        else if (arg == "--seed" && hasValue) options.seed = strtoull(argv[++i], NULL, 10);
+        else if (arg == "--target" && hasValue) options.target = argv[++i];
+        else if (arg == "--cgi" && hasValue) options.cgi = argv[++i];
+        else if (arg == "--replay" && hasValue) options.replay = argv[++i];
+        else if (arg == "--data" && hasValue) options.dataDir = argv[++i];
+        else return usage(argv[0]);
+    }
+    if (!options.target.empty() && !options.cgi.empty()) return usage(argv[0]);
+    int threads = options.threads > 0 ? options.threads : max(1u, thread::hardware_concurrency());
+    signal(SIGPIPE, SIG_IGN);
+
+    DriverKind kind = !options.target.empty() ? DRIVER_HTTP : !options.cgi.empty() ? DRIVER_CGI : DRIVER_IN_PROCESS;
+    Client prototype;
+    prototype.kind = kind;
+    if (kind == DRIVER_HTTP && !parseTarget(options.target, prototype)) {
+        fprintf(stderr, "cannot resolve %s\n", options.target.c_str());
+        return 1;
+    }
+    if (kind == DRIVER_CGI) {
+        char resolved[PATH_MAX];
+        if (realpath(options.cgi.c_str(), resolved) == NULL) {
+            perror(options.cgi.c_str());
+            return 1;
+        }
+        prototype.cgi = resolved;
+    }
+
+    // Replayed requests are dealt out by client, so each client's requests
+    // stay in order on one worker
+    vector<Worker> workers(threads);
+    size_t skipped = 0;
+    if (!options.replay.empty()) {
+        ifstream log(options.replay);
+        if (!log.is_open()) {
+            perror(options.replay.c_str());
+            return 1;
+        }
+        string line, client, method, query;
+        while (getline(log, line)) {
+            if (!parseAccessLogLine(line, client, method, query) || method != "GET") {
+                skipped++;
+                continue;
+            }
+            uint64_t id = hash<string>()(client);
+            workers[id % threads].replay.push_back({syntheticSession(options.seed, id), {requestLabel(query), query}});
+        }
+    }
+
+    // State of in-process and CGI runs lives in the data directory, which
+    // is also where the handlers look for mental_health_config.txt
+    if (kind != DRIVER_HTTP) {
+        if (options.dataDir.empty()) {
+            char dirTemplate[] = "/tmp/mhs-loadgen-XXXXXX";
+            if (mkdtemp(dirTemplate) == NULL) {
+                perror("mkdtemp");
+                return 1;
+            }
+            options.dataDir = dirTemplate;
+        }
+        mkdir(options.dataDir.c_str(), 0755);
+        if (chdir(options.dataDir.c_str()) != 0) {
+            perror(options.dataDir.c_str());
+            return 1;
+        }
+    }
+    shared_ptr<const AppConfig> config = currentConfig();
+    const vector<MoodId>& moods = config->offeredMoods;
+
+    ServerContext* ctx = nullptr;
+    if (kind == DRIVER_IN_PROCESS) {
+        ctx = new ServerContext;
+        thread(runCompactor, ref(*ctx)).detach();
+        thread(runGroupCommit, ref(ctx->commits)).detach();
+        thread(runAggregator).detach();
+    }
+    for (Worker& worker : workers) {
+        worker.client = prototype;
+        worker.client.ctx = ctx;
+        if (kind == DRIVER_IN_PROCESS && (worker.client.out = memfd_create("loadgen-response", 0)) < 0) {
+            perror("memfd_create");
+            return 1;
+        }
+    }
+
+    fprintf(stderr, "%s: %s, %d threads%s%s\n", options.replay.empty() ? "synthetic population" : "replay",
+            kind == DRIVER_HTTP ? options.target.c_str() : kind == DRIVER_CGI ? prototype.cgi.c_str() : "in process",
+            threads, kind != DRIVER_HTTP ? ", state in " : "", kind != DRIVER_HTTP ? options.dataDir.c_str() : "");
+    if (skipped > 0) fprintf(stderr, "skipped %zu log lines that are not GET requests\n", skipped);
+
+    // Replays run to the end of the log unless --requests caps them
+    size_t limit = options.duration > 0 && !options.requestsSet ? SIZE_MAX :
+                   !options.replay.empty() && !options.requestsSet ? SIZE_MAX : options.requests;
+    atomic<size_t> issued(0);
+    auto start = chrono::steady_clock::now();
+    auto deadline = start + chrono::duration_cast<chrono::steady_clock::duration>(
+                                chrono::duration<double>(options.duration > 0 ? options.duration : 1e9));
+    auto keepGoing = [&]() {
+        return issued.fetch_add(1, memory_order_relaxed) < limit && chrono::steady_clock::now() < deadline;
+    };
+
+    vector<thread> running;
+    for (int t = 0; t < threads; t++) {
+        running.emplace_back([&, t] {
+            Worker& worker = workers[t];
+            if (!options.replay.empty()) {
+                for (const auto& request : worker.replay) {
+                    if (!keepGoing()) return;
+                    worker.run(request.second, request.first);
+                }
+                return;
+            }
+            // This worker owns users t, t + threads, t + 2 * threads... so
+            // each user's mood chain is only advanced by one thread
+            size_t owned = options.users / threads + ((size_t)t < options.users % threads ? 1 : 0);
+            if (owned == 0) return;
+            mt19937_64 random(splitMix64(options.seed * 1000003 + t));
+            vector<discrete_distribution<size_t>> transitions = moodTransitions(moods);
+            vector<uint8_t> userMoods(owned);
+            for (uint8_t& mood : userMoods) mood = moods.empty() ? 0 : (uint8_t)(random() % moods.size());
+            vector<Request> visit;
+            while (true) {
+                size_t slot = random() % owned;
+                string session = syntheticSession(options.seed, t + slot * threads);
+                visit.clear();
+                planVisit(random, moods, transitions, userMoods[slot], visit);
+                for (const Request& request : visit) {
+                    if (!keepGoing()) return;
+                    worker.run(request, session);
+                }
+            }
+        });
+    }
+    for (thread& worker : running) worker.join();
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    // Let queued and running compactions finish before reporting and exiting
+    if (ctx != nullptr) waitForCompactions(*ctx);
+
+    map<string, ActionStats> merged;
+    ActionStats total;
+    for (Worker& worker : workers) {
+        for (auto& action : worker.stats) {
+            ActionStats& into = merged[action.first];
+            into.latencies.insert(into.latencies.end(), action.second.latencies.begin(), action.second.latencies.end());
+            into.errors += action.second.errors;
+            total.latencies.insert(total.latencies.end(), action.second.latencies.begin(), action.second.latencies.end());
+            total.errors += action.second.errors;
+        }
+    }
+    if (!options.json) {
+        printf("%-18s %10s %8s %11s %9s %9s %9s %9s %9s\n", "action", "requests", "errors", "req/s", "p50 ms",
+               "p90 ms", "p99 ms", "p99.9 ms", "max ms");
+    }
+    for (auto& action : merged) reportStats(options, action.first, action.second, seconds);
+    reportStats(options, "total", total, seconds);
+    return total.errors > 0 ? 1 : 0;
+}